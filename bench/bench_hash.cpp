@@ -0,0 +1,67 @@
+// str_hash() (wyhash) against the FNV-1a it replaced, by key length.
+#include "shared.h"
+#include <chrono>
+#include <stdio.h>
+#include <vector>
+
+// str_hash() as it was before wyhash
+static uint64_t fnv_hash(const uint8_t *data, size_t len) {
+  uint32_t h = 0x811C9DC5;
+  for (size_t i = 0; i < len; i++) {
+    h = (h + data[i]) * 0x01000193;
+  }
+  return h;
+}
+
+static uint64_t g_rng = 88172645463325252ull;
+
+static uint64_t rng_next() {
+  g_rng ^= g_rng << 13;
+  g_rng ^= g_rng >> 7;
+  g_rng ^= g_rng << 17;
+  return g_rng;
+}
+
+static double now_sec() {
+  using namespace std::chrono;
+  return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+// bytes hashed per length and function, enough for a stable time
+const size_t k_bytes = 256 << 20;
+// keys are taken at different offsets of a buffer that fits in the cache
+const size_t k_buf_size = 64 << 10;
+
+// ns per hash of independent keys, as in a hashtable
+static double bench(uint64_t (*hash)(const uint8_t *, size_t),
+                    const std::vector<uint8_t> &buf, size_t len,
+                    uint64_t &sink) {
+  size_t n = k_bytes / len;
+  size_t span = buf.size() - len;
+  uint64_t sum = 0;
+  double t0 = now_sec();
+  for (size_t i = 0; i < n; i++) {
+    size_t off = (i * 4099) % span;
+    sum += hash(&buf[off], len);
+  }
+  double t1 = now_sec();
+  sink ^= sum;
+  return (t1 - t0) * 1e9 / n;
+}
+
+int main() {
+  hash_init(rng_next());
+  std::vector<uint8_t> buf(k_buf_size);
+  for (uint8_t &b : buf) {
+    b = (uint8_t)rng_next();
+  }
+  size_t lens[] = {8, 16, 32, 64, 128, 256, 1024, 4096};
+  uint64_t sink = 0;
+  printf("%-8s %10s %10s  (ns/hash)\n", "length", "fnv", "wyhash");
+  for (size_t len : lens) {
+    double fnv = bench(&fnv_hash, buf, len, sink);
+    double wy = bench(&str_hash, buf, len, sink);
+    printf("%-8zu %10.1f %10.1f\n", len, fnv, wy);
+  }
+  return sink == 42; // keeps the hashes from being optimized out
+}
@@ -0,0 +1,126 @@
+// The hashtable engine it's built with (chaining, or swiss with
+// HMAP_SWISS): inserting, looking up present and missing keys, and
+// deleting, at sizes up to 100M keys.
+#include "hashtable.h"
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#ifdef HMAP_SWISS
+static const char *k_engine = "swiss";
+#else
+static const char *k_engine = "chaining";
+#endif
+
+// as small as a key gets, so that 100M of them fit in memory
+struct Key {
+  HNode node;
+  uint64_t val = 0;
+};
+
+static bool key_eq(HNode *a, HNode *b) {
+  return ((Key *)a)->val == ((Key *)b)->val;
+}
+
+// stands in for hashing a string key
+static uint64_t int_hash(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xFF51AFD7ED558CCDull;
+  x ^= x >> 33;
+  x *= 0xC4CEB9FE1A85EC53ull;
+  return x ^ (x >> 33);
+}
+
+static uint64_t g_rng = 88172645463325252ull;
+
+static uint64_t rng_next() {
+  g_rng ^= g_rng << 13;
+  g_rng ^= g_rng >> 7;
+  g_rng ^= g_rng << 17;
+  return g_rng;
+}
+
+static double now_sec() {
+  using namespace std::chrono;
+  return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+// Random lookups are capped, they cost the same at any count
+const size_t k_max_lookups = 10000000;
+
+struct Result {
+  double insert = 0;
+  double hit = 0;
+  double miss = 0;
+  double del = 0;
+  double mem = 0; // bytes of slots per key, when full
+};
+
+static size_t lookup_random(HMap *hmap, size_t ops, uint64_t base,
+                            uint64_t range) {
+  size_t found = 0;
+  Key key;
+  for (size_t i = 0; i < ops; i++) {
+    key.val = base + rng_next() % range;
+    key.node.hcode = int_hash(key.val);
+    found += hm_lookup(hmap, &key.node, &key_eq) != NULL;
+  }
+  return found;
+}
+
+static Result bench(size_t n) {
+  std::vector<Key> keys(n);
+  HMap hmap;
+  Result res;
+  double t0 = now_sec();
+  for (size_t i = 0; i < n; i++) {
+    keys[i].val = i;
+    keys[i].node.hcode = int_hash(i);
+    hm_insert(&hmap, &keys[i].node);
+  }
+  double t1 = now_sec();
+  size_t ops = n < k_max_lookups ? n : k_max_lookups;
+  size_t hits = lookup_random(&hmap, ops, 0, n);
+  double t2 = now_sec();
+  size_t misses = ops - lookup_random(&hmap, ops, n, n);
+  double t3 = now_sec();
+  if (hits != ops || misses != ops) {
+    fprintf(stderr, "bad lookups: %zu hits, %zu misses\n", hits, misses);
+    exit(1);
+  }
+  res.mem = (double)hm_mem(&hmap) / n;
+  Key key;
+  for (size_t i = 0; i < n; i++) {
+    key.val = i;
+    key.node.hcode = keys[i].node.hcode;
+    if (!hm_delete(&hmap, &key.node, &key_eq)) {
+      fprintf(stderr, "key %zu not found\n", i);
+      exit(1);
+    }
+  }
+  double t4 = now_sec();
+  hm_clear(&hmap);
+  res.insert = (t1 - t0) * 1e9 / n;
+  res.hit = (t2 - t1) * 1e9 / ops;
+  res.miss = (t3 - t2) * 1e9 / ops;
+  res.del = (t4 - t3) * 1e9 / n;
+  return res;
+}
+
+int main(int argc, char **argv) {
+  size_t sizes[] = {1000000, 10000000, 100000000};
+  size_t nsizes = argc > 1 ? 1 : 3;
+  if (argc > 1) {
+    sizes[0] = strtoull(argv[1], NULL, 10);
+  }
+  printf("%-10s %-9s %8s %8s %8s %8s %8s\n", "keys", "engine", "insert",
+         "hit", "miss", "delete", "B/key");
+  for (size_t s = 0; s < nsizes; s++) {
+    Result r = bench(sizes[s]);
+    printf("%-10zu %-9s %8.1f %8.1f %8.1f %8.1f %8.1f\n", sizes[s], k_engine,
+           r.insert, r.hit, r.miss, r.del, r.mem);
+  }
+  printf("(ns/op; B/key: the slots, not the keys)\n");
+  return 0;
+}
@@ -0,0 +1,120 @@
+// ZADD/ZREM churn of a large sorted set: throughput and RSS with the slab
+// allocator, or with malloc when built with SLAB_MALLOC.
+#include "slab.h"
+#include "zset.h"
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#ifdef SLAB_MALLOC
+// slab.h served by malloc, as before the slab allocator
+static const char *k_alloc = "malloc";
+
+size_t slab_round(size_t n) { return n; }
+void *slab_alloc(size_t n) {
+  void *ptr = malloc(n);
+  if (!ptr) {
+    abort();
+  }
+  return ptr;
+}
+void slab_free(void *ptr, size_t) { free(ptr); }
+void slab_collect() {}
+SlabStats slab_stats() { return SlabStats(); }
+SlabStats slab_thread_stats() { return SlabStats(); }
+bool slab_defrag_hint(void *, size_t) { return false; }
+#else
+static const char *k_alloc = "slab";
+#endif
+
+static uint64_t g_rng = 88172645463325252ull;
+
+static uint64_t rng_next() {
+  g_rng ^= g_rng << 13;
+  g_rng ^= g_rng >> 7;
+  g_rng ^= g_rng << 17;
+  return g_rng;
+}
+
+static double now_sec() {
+  using namespace std::chrono;
+  return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+static double rss_mb() {
+  long pages = 0, resident = 0;
+  FILE *fp = fopen("/proc/self/statm", "r");
+  if (!fp || fscanf(fp, "%ld %ld", &pages, &resident) != 2) {
+    resident = 0;
+  }
+  if (fp) {
+    fclose(fp);
+  }
+  return (double)resident * sysconf(_SC_PAGESIZE) / (1 << 20);
+}
+
+// member names of 8 to 40 bytes, spread over the size classes
+static size_t member_name(uint64_t id, char *buf) {
+  size_t len = 8 + id % 33;
+  int n = snprintf(buf, len + 1, "m%llu", (unsigned long long)id);
+  for (size_t i = (size_t)n; i < len; i++) {
+    buf[i] = 'a' + (char)(i % 26);
+  }
+  return len;
+}
+
+const size_t k_rounds = 6;
+
+int main(int argc, char **argv) {
+  size_t n = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+  ZSet *zset = new ZSet();
+  std::vector<uint64_t> live(n);
+  uint64_t next_id = 0;
+  char name[64];
+
+  double t0 = now_sec();
+  for (size_t i = 0; i < n; i++) {
+    live[i] = next_id++;
+    size_t len = member_name(live[i], name);
+    zset_insert(zset, name, len, (double)(rng_next() % 1000000));
+  }
+  double t1 = now_sec();
+  double rss_fill = rss_mb();
+
+  // each round removes a random half and adds as many new members
+  for (size_t r = 0; r < k_rounds; r++) {
+    for (size_t i = 0; i < n / 2; i++) {
+      size_t j = rng_next() % (n - i);
+      std::swap(live[j], live[n - i - 1]);
+      size_t len = member_name(live[n - i - 1], name);
+      if (!zset_delete(zset, name, len)) {
+        fprintf(stderr, "member %s not found\n", name);
+        return 1;
+      }
+    }
+    for (size_t i = n - n / 2; i < n; i++) {
+      live[i] = next_id++;
+      size_t len = member_name(live[i], name);
+      zset_insert(zset, name, len, (double)(rng_next() % 1000000));
+    }
+    slab_collect();
+  }
+  double t2 = now_sec();
+  double rss_churn = rss_mb();
+  if (zset_size(zset) != n) {
+    fprintf(stderr, "size %zu, expected %zu\n", zset_size(zset), n);
+    return 1;
+  }
+  zset_clear(zset);
+  delete zset;
+
+  double churn_ops = (double)k_rounds * (n / 2) * 2;
+  printf("%-8s %zu members: fill %.0f ops/s, churn %.0f ops/s, "
+         "RSS %.1f MB after fill, %.1f MB after churn\n",
+         k_alloc, n, n / (t1 - t0), churn_ops / (t2 - t1), rss_fill,
+         rss_churn);
+  return 0;
+}
@@ -0,0 +1,204 @@
+// Timing wheel against the binary heap it replaced for the key TTLs:
+// adding, removing and popping expired timers.
+#include "timing_wheel.h"
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+// the TTL heap, as it was before the timing wheel
+struct HeapItem {
+  uint64_t val = 0;
+  size_t *ref = NULL;
+};
+
+static size_t get_parent(size_t i) { return (i + 1) / 2 - 1; }
+static size_t get_left(size_t i) { return i * 2 + 1; }
+static size_t get_right(size_t i) { return i * 2 + 2; }
+
+static void bubble_up(HeapItem *a, size_t pos) {
+  HeapItem t = a[pos];
+  while (pos > 0 && a[get_parent(pos)].val > t.val) {
+    a[pos] = a[get_parent(pos)];
+    *a[pos].ref = pos;
+    pos = get_parent(pos);
+  }
+  a[pos] = t;
+  *a[pos].ref = pos;
+}
+
+static void bubble_down(HeapItem *a, size_t pos, size_t len) {
+  HeapItem t = a[pos];
+  while (true) {
+    size_t l = get_left(pos);
+    size_t r = get_right(pos);
+    size_t min_pos = pos;
+    uint64_t min_val = t.val;
+    if (l < len && a[l].val < min_val) {
+      min_pos = l;
+      min_val = a[l].val;
+    }
+    if (r < len && a[r].val < min_val) {
+      min_pos = r;
+    }
+    if (min_pos == pos) {
+      break;
+    }
+    a[pos] = a[min_pos];
+    *a[pos].ref = pos;
+    pos = min_pos;
+  }
+  a[pos] = t;
+  *a[pos].ref = pos;
+}
+
+static void heap_update(HeapItem *a, size_t pos, size_t len) {
+  if (pos > 0 && a[get_parent(pos)].val > a[pos].val) {
+    bubble_up(a, pos);
+  } else {
+    bubble_down(a, pos, len);
+  }
+}
+
+static void heap_delete(std::vector<HeapItem> &a, size_t pos) {
+  a[pos] = a.back();
+  a.pop_back();
+  if (pos < a.size()) {
+    heap_update(a.data(), pos, a.size());
+  }
+}
+
+static void heap_upsert(std::vector<HeapItem> &a, size_t pos, HeapItem t) {
+  if (pos < a.size()) {
+    a[pos] = t;
+  } else {
+    pos = a.size();
+    a.push_back(t);
+  }
+  heap_update(a.data(), pos, a.size());
+}
+
+// a key with a TTL, as the entries embed either one
+struct HeapKey {
+  size_t heap_idx = (size_t)-1;
+};
+
+struct WheelKey {
+  TimerNode ttl;
+};
+
+const uint64_t k_span = 3600 * 1000; // of the expiry times, ms
+
+static uint64_t g_rng = 1;
+
+static uint64_t rng_next() {
+  g_rng ^= g_rng << 13;
+  g_rng ^= g_rng >> 7;
+  g_rng ^= g_rng << 17;
+  return g_rng;
+}
+
+static double now_sec() {
+  using namespace std::chrono;
+  return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+struct Result {
+  double add = 0;    // ns per op
+  double remove = 0;
+  double pop = 0;
+};
+
+// timers expiring over an hour, half of them removed in `order`, the
+// rest expired
+static Result bench_heap(const std::vector<uint64_t> &expire,
+                         const std::vector<size_t> &order) {
+  size_t n = expire.size();
+  std::vector<HeapKey> keys(n);
+  std::vector<HeapItem> heap;
+  Result res;
+  double t0 = now_sec();
+  for (size_t i = 0; i < n; i++) {
+    heap_upsert(heap, keys[i].heap_idx, {expire[i], &keys[i].heap_idx});
+  }
+  double t1 = now_sec();
+  for (size_t i = 0; i < n / 2; i++) {
+    HeapKey &key = keys[order[i]];
+    heap_delete(heap, key.heap_idx);
+    key.heap_idx = (size_t)-1;
+  }
+  double t2 = now_sec();
+  size_t popped = 0;
+  while (!heap.empty()) {
+    *heap[0].ref = (size_t)-1;
+    heap_delete(heap, 0);
+    popped++;
+  }
+  double t3 = now_sec();
+  res.add = (t1 - t0) * 1e9 / n;
+  res.remove = (t2 - t1) * 1e9 / (n / 2);
+  res.pop = (t3 - t2) * 1e9 / popped;
+  return res;
+}
+
+static Result bench_wheel(const std::vector<uint64_t> &expire,
+                          const std::vector<size_t> &order, uint64_t start) {
+  size_t n = expire.size();
+  std::vector<WheelKey> keys(n);
+  TimingWheel *tw = new TimingWheel();
+  tw_init(tw, start);
+  Result res;
+  double t0 = now_sec();
+  for (size_t i = 0; i < n; i++) {
+    tw_add(tw, &keys[i].ttl, expire[i]);
+  }
+  double t1 = now_sec();
+  for (size_t i = 0; i < n / 2; i++) {
+    tw_remove(tw, &keys[order[i]].ttl);
+  }
+  double t2 = now_sec();
+  // all of them expired, as the heap is drained
+  size_t popped = 0;
+  while (tw_pop(tw, start + k_span + 1)) {
+    popped++;
+  }
+  double t3 = now_sec();
+  delete tw;
+  res.add = (t1 - t0) * 1e9 / n;
+  res.remove = (t2 - t1) * 1e9 / (n / 2);
+  res.pop = (t3 - t2) * 1e9 / popped;
+  return res;
+}
+
+int main(int argc, char **argv) {
+  size_t sizes[] = {10000, 1000000, 10000000};
+  size_t nsizes = argc > 1 ? 1 : 3;
+  if (argc > 1) {
+    sizes[0] = strtoull(argv[1], NULL, 10);
+  }
+  const uint64_t start = 1000000;
+  printf("%-10s %-6s %10s %10s %10s  (ns/op)\n", "timers", "", "add",
+         "remove", "pop");
+  for (size_t s = 0; s < nsizes; s++) {
+    size_t n = sizes[s];
+    std::vector<uint64_t> expire(n);
+    std::vector<size_t> order(n);
+    for (size_t i = 0; i < n; i++) {
+      expire[i] = start + 1 + rng_next() % k_span;
+      order[i] = i;
+    }
+    for (size_t i = n - 1; i > 0; i--) {
+      size_t j = rng_next() % (i + 1);
+      size_t t = order[i];
+      order[i] = order[j];
+      order[j] = t;
+    }
+    Result heap = bench_heap(expire, order);
+    Result wheel = bench_wheel(expire, order, start);
+    printf("%-10zu %-6s %10.1f %10.1f %10.1f\n", n, "heap", heap.add,
+           heap.remove, heap.pop);
+    printf("%-10zu %-6s %10.1f %10.1f %10.1f\n", n, "wheel", wheel.add,
+           wheel.remove, wheel.pop);
+  }
+  return 0;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "mem_stats.h"
+#include <atomic>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+
+// Immutable reference counted string value. The keyspace holds one
+// reference and the output buffers sending the value hold more, so large
+// values are written to sockets without being copied, and stay alive until
+// written even if the key is overwritten or deleted meanwhile.
+// The count is atomic since I/O threads and other shards release it.
+struct Blob {
+  std::atomic<uint32_t> refs{1};
+  std::string str;
+};
+
+inline Blob *blob_new(std::string_view str) {
+  Blob *blob = new Blob();
+  blob->str.assign(str);
+  mem_add(MEM_VALUES, (int64_t)(sizeof(Blob) + blob->str.capacity()));
+  return blob;
+}
+
+inline void blob_ref(Blob *blob) {
+  blob->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+inline void blob_unref(Blob *blob) {
+  if (blob->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    mem_add(MEM_VALUES, -(int64_t)(sizeof(Blob) + blob->str.capacity()));
+    delete blob;
+  }
+}
@@ -1,11 +1,72 @@
 #ifndef BUFFER_H
 #define BUFFER_H
 
+#include "mem_stats.h"
+#include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <sys/uio.h>
 #include <vector>
 
-// Buffer type for data handling
-typedef std::vector<uint8_t> Buffer;
+struct Blob;
+
+// A value spliced into a buffer by reference
+struct BufRef {
+  uint64_t at = 0; // own bytes before it, counted from BufRefs::base
+  Blob *blob = NULL;
+};
+
+// The references of a buffer, allocated only while there are any
+struct BufRefs {
+  std::vector<BufRef> list;
+  size_t head = 0;     // the first one not consumed yet
+  size_t head_off = 0; // consumed bytes of the head
+  uint64_t base = 0;   // own bytes consumed since the creation
+};
+
+// Byte buffer for data handling, appended at the back and consumed from
+// the front. The data lives in [begin, end) of one allocation: consuming
+// only moves `begin`, and the consumed space is reclaimed when appending
+// needs room and the data is no bigger than it, so every byte is moved
+// O(1) times. The data stays contiguous for parsing.
+// An output buffer is a chain of segments: besides its own bytes it can
+// reference large values, see buf_append_ref(). size(), data() and
+// indexing are about the own bytes only.
+struct Buffer {
+  uint8_t *buf = NULL;    // allocation
+  size_t cap = 0;         // allocation size
+  size_t begin = 0;       // start of the data
+  size_t end = 0;         // end of the data, start of the free tail
+  BufRefs *refs = NULL;   // referenced values
+
+  Buffer() = default;
+  Buffer(const Buffer &) = delete;
+  Buffer &operator=(const Buffer &) = delete;
+  Buffer(Buffer &&other) noexcept { swap(other); }
+  Buffer &operator=(Buffer &&other) noexcept {
+    Buffer tmp;
+    tmp.swap(other);
+    swap(tmp);
+    return *this;
+  }
+  ~Buffer() {
+    clear();
+    free(buf);
+    mem_add(MEM_BUFFERS, -(int64_t)cap);
+  }
+
+  size_t size() const { return end - begin; }
+  bool empty() const { return end == begin && !refs; }
+  size_t capacity() const { return cap; }
+  uint8_t *data() { return buf + begin; }
+  const uint8_t *data() const { return buf + begin; }
+  uint8_t &operator[](size_t i) { return buf[begin + i]; }
+  const uint8_t &operator[](size_t i) const { return buf[begin + i]; }
+  void clear();
+  void push_back(uint8_t c);
+  void resize(size_t n);
+  void swap(Buffer &other);
+};
 
 // Buffer operations
 void buf_append(Buffer &buf, const uint8_t *data, size_t len);
@@ -15,4 +76,23 @@ void buf_append_u32(Buffer &buf, uint32_t data);
 void buf_append_i64(Buffer &buf, int64_t data);
 void buf_append_dbl(Buffer &buf, double data);
 
+// Segments: reference a value instead of copying it (the buffer takes a
+// reference), list the segments for writev(), or move all of them over
+void buf_append_ref(Buffer &buf, Blob *blob);
+size_t buf_iov(Buffer &buf, struct iovec *iov, Blob **blobs, size_t max);
+size_t buf_ref_bytes(Buffer &buf, size_t pos);
+void buf_append_buf(Buffer &dst, Buffer &src);
+
+// Writing into the free tail directly, e.g. with read():
+// reserve space, write at buf_tail(), then add the written bytes
+void buf_reserve(Buffer &buf, size_t n);
+inline uint8_t *buf_tail(Buffer &buf) { return buf.buf + buf.end; }
+inline size_t buf_tail_size(const Buffer &buf) { return buf.cap - buf.end; }
+inline void buf_advance(Buffer &buf, size_t n) { buf.end += n; }
+
+// Per thread pool of buffer memory. Buffers that run empty give their
+// memory back, so that idle connections don't hold any.
+void buf_acquire(Buffer &buf);
+void buf_release(Buffer &buf);
+
 #endif // BUFFER_H
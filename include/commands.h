@@ -2,18 +2,91 @@
 #define COMMANDS_H
 
 #include "buffer.h"
-#include <string>
+#include <stdint.h>
+#include <string_view>
+#include <vector>
 
 // Command handlers
-void do_get(std::vector<std::string> &cmd, Buffer &out);
-void do_set(std::vector<std::string> &cmd, Buffer &out);
-void do_del(std::vector<std::string> &cmd, Buffer &out);
-void do_expire(std::vector<std::string> &cmd, Buffer &out);
-void do_ttl(std::vector<std::string> &cmd, Buffer &out);
-void do_keys(std::vector<std::string> &cmd, Buffer &out);
-void do_zadd(std::vector<std::string> &cmd, Buffer &out);
-void do_zrem(std::vector<std::string> &cmd, Buffer &out);
-void do_zscore(std::vector<std::string> &cmd, Buffer &out);
-void do_zquery(std::vector<std::string> &cmd, Buffer &out);
+void do_get(std::vector<std::string_view> &cmd, Buffer &out);
+void do_set(std::vector<std::string_view> &cmd, Buffer &out);
+void do_del(std::vector<std::string_view> &cmd, Buffer &out);
+void do_expire(std::vector<std::string_view> &cmd, Buffer &out);
+void do_ttl(std::vector<std::string_view> &cmd, Buffer &out);
+void do_keys(std::vector<std::string_view> &cmd, Buffer &out);
+void do_zadd(std::vector<std::string_view> &cmd, Buffer &out);
+void do_zrem(std::vector<std::string_view> &cmd, Buffer &out);
+void do_zscore(std::vector<std::string_view> &cmd, Buffer &out);
+void do_zquery(std::vector<std::string_view> &cmd, Buffer &out);
+void do_info(std::vector<std::string_view> &cmd, Buffer &out);
+void do_ping(std::vector<std::string_view> &cmd, Buffer &out);
+void do_hello(std::vector<std::string_view> &cmd, Buffer &out);
+void do_mget(std::vector<std::string_view> &cmd, Buffer &out);
+void do_mset(std::vector<std::string_view> &cmd, Buffer &out);
+void do_scan(std::vector<std::string_view> &cmd, Buffer &out);
+void do_incr(std::vector<std::string_view> &cmd, Buffer &out);
+void do_decr(std::vector<std::string_view> &cmd, Buffer &out);
+void do_incrby(std::vector<std::string_view> &cmd, Buffer &out);
+void do_decrby(std::vector<std::string_view> &cmd, Buffer &out);
+void do_incrbyfloat(std::vector<std::string_view> &cmd, Buffer &out);
+void do_memory(std::vector<std::string_view> &cmd, Buffer &out);
+
+// Command ids, index of the command table
+enum {
+  CMD_GET,
+  CMD_SET,
+  CMD_DEL,
+  CMD_PEXPIRE,
+  CMD_PTTL,
+  CMD_KEYS,
+  CMD_ZADD,
+  CMD_ZREM,
+  CMD_ZSCORE,
+  CMD_ZQUERY,
+  CMD_INFO,
+  CMD_PING,
+  CMD_HELLO,
+  CMD_MGET,
+  CMD_MSET,
+  CMD_MDEL,
+  CMD_SCAN,
+  CMD_INCR,
+  CMD_DECR,
+  CMD_INCRBY,
+  CMD_DECRBY,
+  CMD_INCRBYFLOAT,
+  CMD_MEMORY,
+  CMD_COUNT,
+};
+
+// Command flags
+enum {
+  CMD_READ = 1 << 0,       // Only reads the keyspace
+  CMD_WRITE = 1 << 1,      // May modify the keyspace
+  CMD_ALL_SHARDS = 1 << 2, // Answered by every shard, the arrays are merged
+  CMD_CURSOR = 1 << 3,     // The first arg is a cursor, its shard answers
+  CMD_DENYOOM = 1 << 4,    // May use more memory, refused at maxmemory
+};
+
+// A command table entry
+struct Command {
+  const char *name; // Lower case
+  void (*handler)(std::vector<std::string_view> &cmd, Buffer &out);
+  int32_t arity;      // Number of args with the name, -N: at least N
+  uint32_t flags;     // CMD_*
+  uint32_t first_key; // Position of the first key, 0: no keys
+  int32_t last_key;   // Position of the last key, negative: from the end
+  uint32_t key_step;  // Distance between keys
+};
+
+// Per-command counters, kept by each shard for the requests it executes
+struct CommandStats {
+  uint64_t calls = 0;
+  uint64_t rejected = 0; // Wrong number of arguments, or over maxmemory
+};
+
+extern const Command k_commands[CMD_COUNT];
+
+// Find a command by name, case-insensitive. NULL if unknown.
+const Command *command_lookup(std::string_view name);
 
 #endif // COMMANDS_H
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "event_loop.h"
+#include "evict.h"
+#include <stdint.h>
+
+// Server options, set once from the command line before the loop starts
+struct ServerConfig {
+  uint16_t port = 1234;
+  int backend = EV_BACKEND_EPOLL; // event loop backend
+  uint32_t shards = 1;            // event loop threads, each owns a keyspace
+  uint32_t io_threads = 1;        // threads doing socket I/O, 1: the loop only
+  uint32_t zerocopy = 0; // send values this big with MSG_ZEROCOPY, 0: off
+  uint32_t rehash_us = 100; // idle loop iterations migrating hashtables, 0: off
+  uint32_t defrag_us = 1000; // steps of active defragmentation, 0: off
+  uint64_t maxmemory = 0;   // used memory limit for the writes, 0: none
+  uint32_t maxmemory_policy = EVICT_NONE; // EVICT_*
+  uint32_t maxmemory_samples = 5;         // keys sampled per eviction
+};
+
+inline ServerConfig g_config;
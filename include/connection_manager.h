@@ -6,7 +6,19 @@
 
 // Connection operations
 int32_t handle_accept(int fd);
+Conn *conn_new(int connfd);
 void conn_destroy(Conn *conn);
+void conn_free(Conn *conn);
+bool conn_busy(Conn *conn);
+bool conn_sock_error(Conn *conn);
+void conn_resume(Conn *conn);
+void conn_touch(Conn *conn);
+void conn_trim(Conn *conn);
+void conn_update_events(Conn *conn);
+bool conn_read(Conn *conn);
+int32_t conn_parse(Conn *conn, size_t from,
+                   std::vector<std::string_view> &cmd, size_t *len);
+void conn_split(Conn *conn);
 void handle_read(Conn *conn);
 void handle_write(Conn *conn);
 bool try_one_request(Conn *conn);
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdint.h>
+
+// Active defragmentation. The keys and sorted set members freed at random
+// leave slab pages partly used, that can't be given back. Once enough of
+// the pages of a shard is free, its keyspace is scanned in steps and the
+// entries and nodes on the emptier pages are moved to the fuller ones.
+
+// when defrag_cron() has something to do next, -1 if never
+uint64_t defrag_next_ms();
+
+// check the fragmentation or do a step of a pass, from the timers
+void defrag_cron(uint64_t now_ms);
+
+// entries and nodes moved by all the shards
+uint64_t defrag_moved();
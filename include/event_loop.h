@@ -0,0 +1,45 @@
+#pragma once
+
+#include <poll.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <vector>
+
+// Event backends
+enum {
+  EV_BACKEND_POLL = 0,  // poll(), the fd set is rebuilt on every wait
+  EV_BACKEND_EPOLL = 1, // epoll, interest is registered once per fd
+  EV_BACKEND_URING = 2, // io_uring, completion based, see uring.h
+};
+
+// Readiness flags
+enum : uint32_t {
+  EV_READ = 1,
+  EV_WRITE = 2,
+  EV_ERR = 4, // always reported, no need to register it
+};
+
+// A ready fd returned by ev_wait()
+struct Event {
+  int fd = -1;
+  uint32_t flags = 0;
+};
+
+struct EventLoop {
+  int backend = EV_BACKEND_POLL;
+  // poll backend: registered flags indexed by fd
+  std::vector<uint32_t> interest;
+  std::vector<struct pollfd> poll_args;
+  // epoll backend
+  int epfd = -1;
+  std::vector<struct epoll_event> ready; // batch of ready events
+};
+
+// returns false if the backend is not available
+bool ev_init(EventLoop *loop, int backend);
+void ev_add(EventLoop *loop, int fd, uint32_t flags);
+void ev_mod(EventLoop *loop, int fd, uint32_t flags);
+void ev_del(EventLoop *loop, int fd);
+
+// wait for readiness, returns the number of events or -1 with errno set
+int ev_wait(EventLoop *loop, std::vector<Event> &out, int timeout_ms);
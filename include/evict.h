@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+
+struct Entry;
+
+// What to do with a write that may go over maxmemory
+enum {
+  EVICT_NONE = 0,         // noeviction: refuse it
+  EVICT_ALLKEYS_LRU = 1,  // evict the least recently used keys
+  EVICT_ALLKEYS_LFU = 2,  // evict the least frequently used keys
+  EVICT_VOLATILE_TTL = 3, // evict the keys with a TTL expiring first
+};
+
+// the policy of a name, -1 if unknown
+int evict_policy(const char *name);
+const char *evict_policy_name(uint32_t policy);
+
+// Read the clock for the accesses recorded next, once per event loop
+// iteration rather than once per access
+void evict_clock_update();
+
+// Entry::access of a new entry
+uint32_t evict_access_new();
+
+// record an access to an entry for the LRU and LFU policies
+void evict_touch(Entry *ent);
+
+// Make room before a command that may use more memory: evict keys of this
+// shard while the memory use is over maxmemory. Returns false if it's over
+// and there is nothing left to evict, the command is then refused.
+bool evict_for_write();
+
+// keys evicted by all the shards
+uint64_t evict_count();
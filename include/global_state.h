@@ -2,11 +2,41 @@
 #ifndef GLOBAL_STATE_H
 #define GLOBAL_STATE_H
 
+#include "blob.h"
 #include "buffer.h"
+#include "commands.h"
 #include "dlist.h"
+#include "event_loop.h"
 #include "hashtable.h"
-#include "heap.h"
+#include "timing_wheel.h"
 #include "thread_pool.h"
+#include "uring.h"
+#include <deque>
+#include <string>
+#include <string_view>
+
+// MSG_ZEROCOPY sends whose completion wasn't read yet
+struct ZeroCopy {
+  struct Held {
+    uint32_t seq = 0; // the send's number in the completions
+    Blob *blob = NULL;
+  };
+  uint32_t next_seq = 0;
+  std::deque<Held> held;
+  bool disabled = false;
+};
+
+// A request split by an I/O thread, executed from the front of `incoming`
+struct ConnReq {
+  size_t len = 0; // bytes, consumed once executed
+  uint32_t argc = 0;
+};
+
+// An argument of a ConnReq, at an offset that stays valid if `incoming` moves
+struct ConnArg {
+  uint32_t off = 0; // from the request start
+  uint32_t len = 0;
+};
 
 // Connection struct to manage client connections
 struct Conn {
@@ -16,25 +46,73 @@ struct Conn {
   bool want_read = false;
   bool want_write = false;
   bool want_close = false;
+  bool close_after_reply = false; // after a protocol error, once it's sent
+  uint32_t ev_flags = 0; // flags registered with the event loop
 
   // Buffered input and output per connection
   Buffer incoming; // Data to be parsed by the application
   Buffer outgoing; // Responses generated by the application
+  uint8_t proto = 0; // PROTO_*, sniffed from the first request
+
+  // I/O threads: the requests split from `incoming`, in order
+  std::vector<ConnReq> parsed;
+  std::vector<ConnArg> parsed_args;
+  size_t parsed_head = 0;      // the next one to execute
+  size_t parsed_args_head = 0; // its first argument
+  size_t parsed_bytes = 0;     // of `incoming` covered by the pending ones
+
+  // io_uring backend
+  uint32_t uring_ops = 0;     // In-flight operations referencing this conn
+  bool send_inflight = false; // At most 1 send at a time to keep the order
+  Buffer sending;             // Bytes owned by the in-flight send
+
+  // Values sent with MSG_ZEROCOPY, allocated on the first one
+  ZeroCopy *zc = NULL;
+
+  // Shared-nothing mode: replies still expected from other shards
+  uint32_t remote_pending = 0;
+  struct ShardGather *gather = NULL; // Merged replies of a fan-out command
 
   // Timer for closing idle connections
   uint64_t last_active_ms = 0;
   DList idle_node;
 };
 
-// Global data structure
+struct Shard;
+
+// Per event loop data. Each shard thread owns its own copy, so the data
+// structures are never shared and need no locks.
 struct GlobalData {
   HMap db;                     // Top-level hashtable
+  EventLoop loop;              // Readiness notification backend
+  Uring ring;                  // Completion backend, replaces `loop`
   std::vector<Conn *> fd2conn; // Map of all connections
+  std::vector<Conn *> free_conns; // Closed connections to reuse
   DList idle_list;             // Doubly linked list head
-  std::vector<HeapItem> heap;  // Heap to store TTL
-  ThreadPool thread_pool;      // Thread pool for async operations
+  DList rehash_list;           // Zsets whose hashtable is migrating
+  TimingWheel timers;          // TTL timers
+  Shard *shard = NULL;         // This event loop's mailbox
+  // Arguments of the executing request, views into the connection's
+  // `incoming`. One request runs at a time, so the vector is reused.
+  std::vector<std::string_view> args;
+  CommandStats cmd_stats[CMD_COUNT]; // Requests executed by this shard
+  // Protocol of the response being serialized, set from the connection
+  // before executing a request. HELLO changes it.
+  uint8_t proto = 0;
+  // Copy values into the response instead of referencing them, for the
+  // replies that are merged with the ones of other shards
+  bool out_copy = false;
+  // A part of a split write, the shard that split it passed the maxmemory
+  // gate for the whole command
+  bool write_admitted = false;
 };
 
-inline GlobalData g_data;
+inline thread_local GlobalData g_data;
+
+// Thread pool for async operations, shared by all event loops
+inline ThreadPool g_thread_pool;
+
+// Threads doing the socket I/O and parsing for the event loops
+inline ThreadPool g_io_pool;
 
 #endif // GLOBAL_STATE_H
@@ -12,12 +12,26 @@ struct HNode {
   uint64_t hcode = 0;
 };
 
+#ifdef HMAP_SWISS
+// open addressing hashtable (swiss table style).
+// slots are probed in aligned groups of 16, each slot has a control byte:
+// 0 if empty, 1 if deleted, or 0x80 | 7 bits of the hash if used, so a
+// group is matched against a key with a single SIMD compare.
+struct HTab {
+  uint8_t *ctrl = NULL; // control bytes
+  HNode **slots = NULL; // the nodes
+  size_t mask = 0;      // power of 2 number of slots (at least 16), 2^n - 1
+  size_t size = 0;      // number of keys
+  size_t used = 0;      // keys + deleted slots, limits the probe length
+};
+#else
 // simple hashtable with chaining
 struct HTab {
   HNode **tab = NULL; // array of slots
   size_t mask = 0;    // power of 2 array size, 2^n - 1
   size_t size = 0;    // number of keys
 };
+#endif
 
 // the real hashtable interface.
 // progressively move elements from older to newer table when resizing
@@ -32,17 +46,57 @@ struct HMap {
 // lookup a key in the hashtable
 HNode *hm_lookup(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *));
 
+// keys prefetched together, about the misses a core can have in flight
+const size_t k_prefetch_group = 16;
+
+// prefetch the slots and the first nodes of the chains of `n` keys, so
+// their lookups don't wait for memory one after another
+void hm_prefetch(HMap *hmap, HNode **keys, size_t n);
+
+// look up `n` keys with their memory accesses overlapped,
+// `out[i]` is the node of `keys[i]` or NULL
+void hm_lookup_many(HMap *hmap, HNode **keys, size_t n,
+                    bool (*eq)(HNode *, HNode *), HNode **out);
+
 // insert a key in the hashtable
 void hm_insert(HMap *hmap, HNode *node);
 
 // delete a key from the hashtable
 HNode *hm_delete(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *));
 
+// Replace a node by `node`, a copy of it at another address: its key and
+// `next` are the same. `old` is still readable.
+void hm_replace(HMap *hmap, HNode *old, HNode *node);
+
+// whether keys are being moved from the older table
+bool hm_rehashing(HMap *hmap);
+
+// move some keys from the older table, the same constant work done by
+// every lookup, insert or delete. Returns false once the migration is done.
+bool hm_rehash(HMap *hmap);
+
 // clear the hashtable
 void hm_clear(HMap *hmap);
 
 // get the size of the hashtable
 size_t hm_size(HMap *hmap);
 
+// bytes allocated for the slots of the tables
+size_t hm_mem(const HMap *hmap);
+
 // invoke the callback on each node until it returns false
 void hm_foreach(HMap *hmap, bool (*f)(HNode *, void *), void *arg);
+
+// Random sampling: collect up to `n` nodes from the positions following
+// `pos`, e.g. a random number, looking at no more than n * 10 of them.
+// Returns the number of nodes found.
+size_t hm_sample(HMap *hmap, uint64_t pos, HNode **out, size_t n);
+
+// Incremental iteration: invoke the callback on the nodes of one position
+// of the cursor, starting from 0, and return the next cursor, 0 when done.
+// The cursor counts with its bits reversed, so the positions already
+// visited stay visited when the table grows or shrinks in between: every
+// key present for the whole iteration is seen, some of them twice.
+// The callback must not modify the hashtable.
+uint64_t hm_scan(HMap *hmap, uint64_t cursor, void (*f)(HNode *, void *),
+                 void *arg);
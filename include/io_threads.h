@@ -0,0 +1,24 @@
+#pragma once
+
+#include "global_state.h"
+#include <stdint.h>
+#include <vector>
+
+// Threaded socket I/O. The I/O threads read and parse the requests of the
+// ready connections and write the responses, while the commands still run
+// on the event loop thread, so the data structures need no locks.
+// Each loop iteration is a fan-out/fan-in: read + parse in parallel, then
+// execute in order, then write in parallel.
+
+// a ready connection and its events
+struct IoJob {
+  Conn *conn = NULL;
+  uint32_t flags = 0;
+};
+
+// start the threads, `n` includes the event loop thread
+void io_threads_init(uint32_t n);
+
+// handle the ready connections of a loop iteration, close the ones that
+// want to close
+void io_threads_handle(std::vector<IoJob> &jobs);
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+// Memory accounting categories
+enum {
+  MEM_ENTRIES,    // Entry allocations: header, key, embedded value
+  MEM_VALUES,     // Blobs of the large string values
+  MEM_ZSETS,      // ZSets: listpacks, ZNodes and B+tree nodes
+  MEM_HASHTABLES, // Slot arrays of all the hashtables
+  MEM_BUFFERS,    // Connections, request and response buffers
+  MEM_COUNT,
+};
+
+// Bytes allocated per category, counted by each thread for the memory it
+// allocates or frees. Memory freed by another thread than the one that
+// allocated it, e.g. on the thread pool, makes one count negative but
+// keeps the sum right. Only the owning thread writes, so an update is a
+// plain load and store.
+struct MemCounters {
+  std::atomic<int64_t> bytes[MEM_COUNT] = {};
+  MemCounters();  // registers the thread's counters
+  ~MemCounters(); // adds them to the total of the exited threads
+};
+
+inline thread_local MemCounters g_mem;
+
+inline void mem_add(uint32_t cat, int64_t delta) {
+  std::atomic<int64_t> &c = g_mem.bytes[cat];
+  c.store(c.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+}
+
+// Sum of a category over all threads
+int64_t mem_total(uint32_t cat);
+
+// Sum of all the categories over all threads, the used memory
+int64_t mem_used();
+
+// Resident set size of the process
+size_t mem_rss();
@@ -1,12 +1,28 @@
 #ifndef PROTOCOL_H
 #define PROTOCOL_H
 
+#include "blob.h"
 #include "buffer.h"
 #include <string>
+#include <string_view>
+#include <vector>
 
 // Constants
 const size_t k_max_args = 200 * 1000;
 const size_t k_max_msg = 32 << 20;
+// Values at least this big are referenced by the output instead of copied
+const size_t k_out_ref_min = 16 * 1024;
+
+// Longest RESP header or inline command line
+const size_t k_max_line = 64 * 1024;
+
+// Wire protocols, chosen per connection
+enum {
+  PROTO_NONE = 0,  // Not known yet, sniffed from the first bytes
+  PROTO_BIN = 1,   // Length-prefixed with tagged values, see parse_req()
+  PROTO_RESP2 = 2, // Redis protocol
+  PROTO_RESP3 = 3, // Redis protocol after HELLO 3
+};
 
 // Error codes for TAG_ERR
 enum {
@@ -14,6 +30,7 @@ enum {
   ERR_TOO_BIG = 2, // Response too big
   ERR_BAD_TYP = 3, // Unexpected value type
   ERR_BAD_ARG = 4, // Bad arguments
+  ERR_OOM = 5,     // Over maxmemory with nothing to evict
 };
 
 // Data types of serialized data
@@ -28,17 +45,27 @@ enum {
 
 // Protocol parsing
 int32_t parse_req(const uint8_t *data, size_t size,
-                  std::vector<std::string> &out);
+                  std::vector<std::string_view> &out);
+uint32_t sniff_proto(const uint8_t *data, size_t size);
+int32_t parse_resp(const uint8_t *data, size_t size,
+                   std::vector<std::string_view> &out, size_t *len);
 
-// Protocol serialization
+// Protocol serialization, in the protocol of g_data.proto
 void out_nil(Buffer &out);
 void out_str(Buffer &out, const char *s, size_t size);
+void out_blob(Buffer &out, Blob *blob);
 void out_int(Buffer &out, int64_t val);
 void out_dbl(Buffer &out, double val);
 void out_err(Buffer &out, uint32_t code, const std::string &msg);
+void out_status(Buffer &out, const char *s);
 void out_arr(Buffer &out, uint32_t n);
+void out_map(Buffer &out, uint32_t n);
 size_t out_begin_arr(Buffer &out);
 void out_end_arr(Buffer &out, size_t ctx, uint32_t n);
+size_t parse_arr(const uint8_t *data, size_t size, uint32_t *n);
+uint32_t reply_tag(const uint8_t *data, size_t size);
+size_t reply_size(const uint8_t *data, size_t size);
+int64_t reply_int(const uint8_t *data, size_t size);
 
 // Response formatting
 void response_begin(Buffer &out, size_t *header);
@@ -46,6 +73,12 @@ size_t response_size(Buffer &out, size_t header);
 void response_end(Buffer &out, size_t header);
 
 // Command processing
-void do_request(std::vector<std::string> &cmd, Buffer &out);
+// `c` is the looked up cmd[0], NULL if unknown.
+// The arguments only live until it returns, values to keep are copied.
+struct Command;
+void do_request(const Command *c, std::vector<std::string_view> &cmd,
+                Buffer &out);
+// The maxmemory gate, evicts if needed. Refused: false, with the reply.
+bool admit_write(const Command *c, Buffer &out);
 
 #endif // PROTOCOL_H
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "buffer.h"
+#include <atomic>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct Command;
+struct Conn;
+
+// A request forwarded to the shard owning its key. The same message carries
+// the response back to the source shard.
+struct ShardMsg {
+  std::atomic<ShardMsg *> next{NULL};
+  uint32_t src = 0;              // the shard that owns `conn`
+  uint32_t dst = 0;              // the shard executing the request
+  Conn *conn = NULL;             // only dereferenced by the source shard
+  const Command *command = NULL; // looked up by the source shard
+  uint8_t proto = 0;             // of the response
+  bool merged = false;           // the response is merged with others
+  bool admitted = false;         // a split write, past the maxmemory gate
+  std::vector<std::string> cmd;  // a copy of the request, for the owner
+  Buffer out;                    // the response body
+  bool done = false;             // false: request, true: reply
+};
+
+// lock-free multi-producer single-consumer queue (intrusive, Vyukov style)
+struct MsgQueue {
+  std::atomic<ShardMsg *> head; // producers push here
+  ShardMsg *tail;               // the consumer pops from here
+  ShardMsg stub;
+  MsgQueue() : head(&stub), tail(&stub) {}
+};
+
+// one per event loop thread
+struct Shard {
+  uint32_t id = 0;
+  int wake_fd = -1; // eventfd, readable when the inbox needs attention
+  std::atomic<bool> wake_pending{false};
+  MsgQueue inbox;
+};
+
+// SCAN cursors hold the shard being scanned above these bits, the rest is
+// the position in its hashtable
+const uint32_t k_cursor_shard_shift = 48;
+
+// all shards, set up before the event loops start
+inline std::vector<Shard *> g_shards;
+
+void shards_init(uint32_t n);
+
+// Forward a request to the shards owning its keys, as told by the command
+// table. Returns false if the request should be executed locally instead.
+// A split write refused at maxmemory is answered without forwarding.
+bool shard_forward(Conn *conn, const Command *c,
+                   std::vector<std::string_view> &cmd);
+
+// Handle the messages in this shard's inbox, after a wakeup
+void shard_poll();
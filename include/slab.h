@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Size class allocator for the small objects of the keyspace: entries and
+// sorted set nodes. Each thread allocates from its own pages of equal size
+// slots, without a lock. A slot can be freed by any thread, those frees are
+// handed back to the owning thread, which applies them in slab_collect().
+
+// Largest size served from slab pages, larger ones are malloc()ed
+const size_t k_slab_max = 512;
+
+// The size actually allocated for `n` bytes, the slot size. The room after
+// `n` is usable by the caller.
+size_t slab_round(size_t n);
+
+// Allocate `n` bytes, never NULL
+void *slab_alloc(size_t n);
+
+// Free memory from slab_alloc(n), from any thread
+void slab_free(void *ptr, size_t n);
+
+// Apply the frees made by other threads of memory from this thread's
+// pages. Called by the event loops.
+void slab_collect();
+
+struct SlabStats {
+  int64_t pages = 0; // bytes of the pages
+  int64_t used = 0;  // bytes of the allocated slots
+};
+
+// of all the threads
+SlabStats slab_stats();
+// of the calling thread
+SlabStats slab_thread_stats();
+
+// Whether the memory from slab_alloc(n) at `ptr` is on a page of this
+// thread that is emptier than the others of its size, and would be better
+// moved to a new slab_alloc(n)
+bool slab_defrag_hint(void *ptr, size_t n);
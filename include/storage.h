@@ -1,11 +1,11 @@
 #ifndef STORAGE_H
 #define STORAGE_H
 
+#include "blob.h"
 #include "hashtable.h"
-#include "heap.h"
+#include "timing_wheel.h"
 #include "zset.h"
-#include <string>
-#include <vector>
+#include <string_view>
 
 // Value types
 enum {
@@ -14,36 +14,83 @@ enum {
   T_ZSET = 2, // Sorted set
 };
 
-// KV pair for the top-level hashtable
+// String value encodings
+enum {
+  ENC_EMBED = 0, // In the entry's allocation, after the key
+  ENC_BLOB = 1,  // A separate Blob, large values are sent without a copy
+  ENC_INT = 2,   // A value that reads back the same as an int64, as a number.
+                 // Such values always have this encoding.
+};
+
+// Largest string value stored in the entry. With the rest of its slab slot,
+// the room for it fits in Entry::vcap.
+const size_t k_embed_max = 64;
+static_assert(k_embed_max + 31 <= 255, "Entry::vcap is 8 bits");
+
+// Longest int64 in decimal, with the sign
+const size_t k_int_str_max = 20;
+
+// KV pair for the top-level hashtable. A single allocation: this header,
+// the key, then a small string value. Only sorted sets have more memory.
 struct Entry {
   struct HNode node;    // Hashtable node
-  std::string key;      // Key to lookup
-  size_t heap_idx = -1; // TTL heap index
-  uint32_t type = 0;    // Whether string or sorted set
-  std::string str;
-  ZSet zset;
+  TimerNode ttl;        // TTL timer
+  uint8_t type = 0;     // Whether string or sorted set
+  uint8_t enc = 0;      // ENC_*, for a string
+  uint8_t vlen = 0;     // Embedded value size
+  uint8_t vcap = 0;     // Room for an embedded value
+  uint32_t klen = 0;    // Key size
+  uint32_t access = 0;  // LRU clock or LFU counter, see evict.cpp
+  union {
+    Blob *blob = NULL; // ENC_BLOB string value
+    int64_t ival;      // ENC_INT string value
+    ZSet *zset;        // Sorted set
+  };
+  char data[0]; // The key, then the embedded value
 };
 
+inline std::string_view entry_key(const Entry *ent) {
+  return std::string_view(ent->data, ent->klen);
+}
+
+// Integer conversions that round trip: no sign or leading zero that
+// wouldn't be printed back
+bool str2int_exact(std::string_view s, int64_t &out);
+size_t int2str(int64_t val, char *buf);
+
+
 // Key lookup struct
 struct LookupKey {
-  struct HNode node; // Hashtable node
-  std::string key;
+  struct HNode node;    // Hashtable node
+  std::string_view key; // Usually points into the request
 };
 
 // Entry operations
-Entry *entry_new(uint32_t type);
+Entry *entry_new(uint32_t type, std::string_view key, std::string_view val);
+// An entry of the keyspace may move to fit a small value, the new address
+// is returned. New entries fit their value.
+Entry *entry_set_str(Entry *ent, std::string_view val);
+void entry_set_int(Entry *ent, int64_t val);
+// The value of a string entry. An integer is converted into `buf`, which
+// holds k_int_str_max bytes.
+std::string_view entry_str(const Entry *ent, char *buf);
+size_t entry_mem(const Entry *ent);
 void entry_del_sync(Entry *ent);
 void entry_del(Entry *ent);
 void entry_set_ttl(Entry *ent, int64_t ttl_ms);
+// Move an entry of the keyspace off a sparse slab page, returns its new
+// address or `ent`. The sorted set nodes are moved by znode_defrag().
+Entry *entry_defrag(Entry *ent);
 
 // Comparison function for the hashtable
 bool entry_eq(HNode *node, HNode *key);
 
-// Heap operations
-void heap_delete(std::vector<HeapItem> &a, size_t pos);
-void heap_upsert(std::vector<HeapItem> &a, size_t pos, HeapItem t);
-
 // ZSet utilities
-ZSet *expect_zset(std::string &s);
+ZSet *expect_zset(std::string_view s);
+void zset_track_rehash(ZSet *zset);
+
+// Background rehashing, when the event loop has nothing else to do
+bool db_rehashing();
+void db_rehash(uint64_t budget_us);
 
 #endif // STORAGE_H
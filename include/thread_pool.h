@@ -19,3 +19,8 @@ struct ThreadPool {
 
 void thread_pool_init(ThreadPool *tp, size_t num_threads);
 void thread_pool_queue(ThreadPool *tp, void (*f)(void *), void *arg);
+
+// Fan-out/fan-in: call f(args[i]) for each of the n args on the pool, the
+// calling thread takes a share of the calls too. Returns once all are done.
+void thread_pool_run_all(ThreadPool *tp, void (*f)(void *), void **args,
+                         size_t n);
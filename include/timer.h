@@ -4,6 +4,7 @@
 #include <cstdint>
 
 uint64_t get_monotonic_msec();
+uint64_t get_monotonic_usec();
 uint32_t next_timer_ms();
 void process_timers();
 
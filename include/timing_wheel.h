@@ -0,0 +1,52 @@
+#pragma once
+
+#include "dlist.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Hierarchical timing wheel with millisecond ticks.
+// Level L has 256 slots, each one covering 256^L ms. A timer is put in the
+// level of the highest byte where its expiry differs from the current tick,
+// and moved down a level when the current tick reaches its slot, so both
+// scheduling and cancelling are O(1). Bitmaps of the non-empty slots let
+// the wheel skip over idle periods instead of ticking through them.
+const uint32_t k_tw_levels = 8; // 8 bits per level cover the 64-bit time
+const uint32_t k_tw_slots = 256;
+
+// should be embedded into the data (intrusive data structure)
+struct TimerNode {
+  DList link;             // in a slot, NULL if not scheduled
+  uint64_t expire_ms = 0; // expires once the time is past this
+};
+
+struct TimingWheel {
+  uint64_t cur_ms = 0; // the next tick to process
+  DList slots[k_tw_levels][k_tw_slots];
+  uint64_t used[k_tw_levels][k_tw_slots / 64]; // non-empty slots
+};
+
+void tw_init(TimingWheel *tw, uint64_t now_ms);
+
+// schedule or reschedule a timer
+void tw_add(TimingWheel *tw, TimerNode *node, uint64_t expire_ms);
+void tw_remove(TimingWheel *tw, TimerNode *node);
+
+inline bool tw_active(const TimerNode *node) { return node->link.next; }
+
+// relink a timer copied to a new address, with the data holding it
+inline void tw_moved(TimerNode *node) {
+  if (tw_active(node)) {
+    node->link.prev->next = &node->link;
+    node->link.next->prev = &node->link;
+  }
+}
+
+// remove and return a timer that has expired by `now_ms`, NULL if none
+TimerNode *tw_pop(TimingWheel *tw, uint64_t now_ms);
+
+// one of the timers expiring first, NULL if none. The timers of a slot
+// above level 0 cover 256^L ms and aren't ordered.
+TimerNode *tw_peek(TimingWheel *tw);
+
+// the time when tw_pop() may return something next, -1 if no timers
+uint64_t tw_next(TimingWheel *tw);
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// io_uring networking backend.
+// Instead of waiting for readiness and then calling read()/write(), the
+// loop keeps a multishot accept and a multishot recv per connection armed,
+// the kernel picks a buffer from a registered ring for each recv, and
+// sends are queued and submitted together once per loop iteration.
+struct Uring {
+  int fd = -1;
+  int listen_fd = -1;
+  // submission queue, shared with the kernel
+  unsigned *sq_head = NULL;
+  unsigned *sq_tail = NULL;
+  unsigned sq_mask = 0;
+  struct io_uring_sqe *sqes = NULL;
+  unsigned sqe_tail = 0; // local tail, published on submit
+  // completion queue, shared with the kernel
+  unsigned *cq_head = NULL;
+  unsigned *cq_tail = NULL;
+  unsigned cq_mask = 0;
+  struct io_uring_cqe *cqes = NULL;
+  // provided buffers for multishot recv
+  struct io_uring_buf_ring *br = NULL;
+  uint8_t *bufs = NULL;
+  uint16_t br_tail = 0;
+  uint64_t wake_buf = 0; // target of the read on the shard's eventfd
+};
+
+struct Conn;
+
+// returns false if the kernel lacks the needed features
+bool uring_init(Uring *ring);
+
+// the event loop, never returns
+void uring_run(Uring *ring, int listen_fd);
+
+// send the pending responses of a connection
+void uring_send(Uring *ring, Conn *conn);
@@ -1,24 +1,62 @@
 #pragma once
 
-#include "avltree.h"
+#include "dlist.h"
 #include "hashtable.h"
+#include <string_view>
+
+struct ZBNode;
+struct ZBLeaf;
+
+// A small sorted set is a listpack: one buffer of (score, name) records in
+// order, searched linearly. It's converted to a B+tree and a hashtable of
+// ZNodes past these limits, and stays so.
+const uint32_t k_zset_lp_max = 64;      // members
+const uint32_t k_zset_lp_max_name = 64; // bytes of a member name
+
+enum {
+  ZSET_LISTPACK = 0,
+  ZSET_TREE = 1,
+};
 
 struct ZSet {
-  AVLNode *root = NULL; // index by (score, name)
-  HMap hmap;            // index by name
+  uint32_t enc = ZSET_LISTPACK;
+  // listpack: records of a double score, a byte of name length, the name
+  char *lp = NULL;
+  uint32_t lp_count = 0; // records
+  uint32_t lp_used = 0;  // bytes
+  uint32_t lp_cap = 0;   // bytes allocated
+  // tree
+  ZBNode *root = NULL; // B+tree index by (score, name)
+  HMap hmap;           // index by name
+  DList rehash_node;   // linked while `hmap` is migrating, see db_rehash()
+  size_t bytes = 0;    // allocated for the listpack, ZNodes and B+tree nodes
 };
 
 struct ZNode {
-  AVLNode tree;
   HNode hmap;
   double score = 0;
   size_t len = 0;
   char name[0]; // flexible array
 };
 
+// A position in the (score, name) order, a slot of a B+tree leaf or a
+// listpack record. Valid until the sorted set is modified.
+struct ZPos {
+  ZBLeaf *leaf = NULL; // tree
+  char *rec = NULL;    // listpack
+  uint32_t idx = 0;    // slot of the leaf, or number of the record
+};
+
 bool zset_insert(ZSet *zset, const char *name, size_t len, double score);
-ZNode *zset_lookup(ZSet *zset, const char *name, size_t len);
-void zset_delete(ZSet *zset, ZNode *node);
-ZNode *zset_seekge(ZSet *zset, double score, const char *name, size_t len);
+bool zset_lookup(ZSet *zset, const char *name, size_t len, double &score);
+bool zset_delete(ZSet *zset, const char *name, size_t len);
+size_t zset_size(ZSet *zset);
+ZPos zset_seekge(ZSet *zset, double score, const char *name, size_t len);
 void zset_clear(ZSet *zset);
-ZNode *znode_offset(ZNode *node, int64_t offset);
+// the member at a position, false past the end
+bool zpos_member(ZPos pos, double &score, std::string_view &name);
+ZPos znode_offset(ZSet *zset, ZPos pos, int64_t offset);
+// move a node off a sparse slab page, returns its new address or `node`
+ZNode *znode_defrag(ZSet *zset, ZNode *node);
+// move the listpack off a sparse slab page, true if it was moved
+bool zset_defrag_listpack(ZSet *zset);
@@ -1,17 +1,249 @@
 #include "buffer.h"
+#include "blob.h"
+#include "shared.h"
+#include <algorithm>
+#include <assert.h>
+#include <string.h>
+#include <utility>
+#include <vector>
+
+void Buffer::push_back(uint8_t c) { buf_append_u8(*this, c); }
+
+static size_t ref_size(BufRefs *refs, size_t i) {
+  size_t size = refs->list[i].blob->str.size();
+  return i == refs->head ? size - refs->head_off : size;
+}
+
+// Drop the references from index `i`
+static void refs_truncate(Buffer &buf, size_t i) {
+  BufRefs *refs = buf.refs;
+  for (size_t j = i; j < refs->list.size(); j++) {
+    blob_unref(refs->list[j].blob);
+  }
+  refs->list.resize(i);
+  if (refs->head >= refs->list.size()) {
+    delete refs;
+    buf.refs = NULL;
+  }
+}
+
+void Buffer::clear() {
+  begin = end = 0;
+  if (refs) {
+    refs_truncate(*this, refs->head);
+  }
+}
+
+void Buffer::resize(size_t n) {
+  if (n > size()) {
+    buf_reserve(*this, n - size());
+    memset(buf + end, 0, n - size());
+  } else if (refs) {
+    // Drop the references after the new end
+    size_t i = refs->list.size();
+    while (i > refs->head && refs->list[i - 1].at > refs->base + n) {
+      i--;
+    }
+    refs_truncate(*this, i);
+  }
+  end = begin + n;
+}
+
+void Buffer::swap(Buffer &other) {
+  std::swap(buf, other.buf);
+  std::swap(cap, other.cap);
+  std::swap(begin, other.begin);
+  std::swap(end, other.end);
+  std::swap(refs, other.refs);
+}
+
+// Make room for `n` more bytes at the tail
+void buf_reserve(Buffer &buf, size_t n) {
+  if (buf_tail_size(buf) >= n) {
+    return;
+  }
+  size_t size = buf.size();
+  // Reclaim the consumed space if it's no smaller than the data, the move
+  // is paid for by the consumed bytes
+  if (buf.begin > 0 && buf.begin >= size) {
+    memmove(buf.buf, buf.buf + buf.begin, size);
+    buf.begin = 0;
+    buf.end = size;
+    if (buf_tail_size(buf) >= n) {
+      return;
+    }
+  }
+  // Grow by doubling
+  size_t cap = buf.cap ? buf.cap * 2 : 256;
+  while (cap < size + n) {
+    cap *= 2;
+  }
+  uint8_t *mem = (uint8_t *)malloc(cap);
+  if (!mem) {
+    die("out of memory");
+  }
+  if (size) {
+    memcpy(mem, buf.buf + buf.begin, size);
+  }
+  free(buf.buf);
+  mem_add(MEM_BUFFERS, (int64_t)(cap - buf.cap));
+  buf.buf = mem;
+  buf.cap = cap;
+  buf.begin = 0;
+  buf.end = size;
+}
 
 // Append data to the buffer
 void buf_append(Buffer &buf, const uint8_t *data, size_t len) {
-  buf.insert(buf.end(), data, data + len);
+  buf_reserve(buf, len);
+  if (len) {
+    memcpy(buf_tail(buf), data, len);
+  }
+  buf.end += len;
+}
+
+static void consume_own(Buffer &buf, size_t n) {
+  assert(n <= buf.size());
+  buf.begin += n;
+  if (buf.begin == buf.end) {
+    buf.begin = buf.end = 0; // Empty, start over at the front for free
+  }
 }
 
-// Remove data from the front of the buffer
+// Remove data from the front of the buffer, O(1) per segment
 void buf_consume(Buffer &buf, size_t n) {
-  buf.erase(buf.begin(), buf.begin() + n);
+  BufRefs *refs = buf.refs;
+  if (!refs) {
+    return consume_own(buf, n);
+  }
+  while (n > 0) {
+    assert(refs->head < refs->list.size() || n <= buf.size());
+    if (refs->head < refs->list.size() &&
+        refs->list[refs->head].at == refs->base) {
+      // In a referenced value
+      size_t k = std::min(n, ref_size(refs, refs->head));
+      refs->head_off += k;
+      n -= k;
+      if (refs->head_off == refs->list[refs->head].blob->str.size()) {
+        blob_unref(refs->list[refs->head].blob);
+        refs->head++;
+        refs->head_off = 0;
+      }
+      continue;
+    }
+    // In the own bytes before the next reference
+    size_t own = buf.size();
+    if (refs->head < refs->list.size()) {
+      own = refs->list[refs->head].at - refs->base;
+    }
+    size_t k = std::min(n, own);
+    consume_own(buf, k);
+    refs->base += k;
+    n -= k;
+  }
+  if (refs->head == refs->list.size()) {
+    delete refs;
+    buf.refs = NULL;
+  }
+}
+
+// Reference a value instead of copying it
+void buf_append_ref(Buffer &buf, Blob *blob) {
+  if (blob->str.empty()) {
+    return;
+  }
+  if (!buf.refs) {
+    buf.refs = new BufRefs();
+  }
+  blob_ref(blob);
+  BufRef ref;
+  ref.at = buf.refs->base + buf.size();
+  ref.blob = blob;
+  buf.refs->list.push_back(ref);
+}
+
+// Describe the first segments for writev(), `blobs` (optional) gets the
+// referenced value of each segment or NULL for the own bytes
+size_t buf_iov(Buffer &buf, struct iovec *iov, Blob **blobs, size_t max) {
+  BufRefs *refs = buf.refs;
+  uint8_t *own = buf.data();
+  size_t own_left = buf.size();
+  uint64_t pos = refs ? refs->base : 0;
+  size_t i = refs ? refs->head : 0;
+  size_t n = 0;
+  while (n < max) {
+    if (refs && i < refs->list.size() && refs->list[i].at == pos) {
+      Blob *blob = refs->list[i].blob;
+      size_t off = i == refs->head ? refs->head_off : 0;
+      iov[n].iov_base = (void *)(blob->str.data() + off);
+      iov[n].iov_len = blob->str.size() - off;
+      if (blobs) {
+        blobs[n] = blob;
+      }
+      n++;
+      i++;
+      continue;
+    }
+    size_t len = own_left;
+    if (refs && i < refs->list.size()) {
+      len = refs->list[i].at - pos;
+    }
+    if (len == 0) {
+      break;
+    }
+    iov[n].iov_base = own;
+    iov[n].iov_len = len;
+    if (blobs) {
+      blobs[n] = NULL;
+    }
+    n++;
+    own += len;
+    own_left -= len;
+    pos += len;
+  }
+  return n;
+}
+
+// Bytes of the values referenced after the own byte at `pos`
+size_t buf_ref_bytes(Buffer &buf, size_t pos) {
+  BufRefs *refs = buf.refs;
+  if (!refs) {
+    return 0;
+  }
+  size_t total = 0;
+  for (size_t i = refs->list.size(); i > refs->head; i--) {
+    if (refs->list[i - 1].at <= refs->base + pos) {
+      break;
+    }
+    total += ref_size(refs, i - 1);
+  }
+  return total;
+}
+
+// Move the content of `src` to the end of `dst`, keeping the references
+void buf_append_buf(Buffer &dst, Buffer &src) {
+  struct iovec iov[16];
+  Blob *blobs[16];
+  while (!src.empty()) {
+    size_t n = buf_iov(src, iov, blobs, 16);
+    size_t total = 0;
+    for (size_t i = 0; i < n; i++) {
+      if (blobs[i] && iov[i].iov_len == blobs[i]->str.size()) {
+        buf_append_ref(dst, blobs[i]);
+      } else {
+        buf_append(dst, (const uint8_t *)iov[i].iov_base, iov[i].iov_len);
+      }
+      total += iov[i].iov_len;
+    }
+    buf_consume(src, total);
+  }
 }
 
 // Append a uint8_t to the buffer
-void buf_append_u8(Buffer &buf, uint8_t data) { buf.push_back(data); }
+void buf_append_u8(Buffer &buf, uint8_t data) {
+  buf_reserve(buf, 1);
+  buf.buf[buf.end++] = data;
+}
 
 // Append a uint32_t to the buffer
 void buf_append_u32(Buffer &buf, uint32_t data) {
@@ -27,3 +259,30 @@ void buf_append_i64(Buffer &buf, int64_t data) {
 void buf_append_dbl(Buffer &buf, double data) {
   buf_append(buf, (const uint8_t *)&data, 8);
 }
+
+// Pooled buffers, bigger ones are freed instead
+const size_t k_pool_max_bufs = 256;
+const size_t k_pool_max_cap = 64 * 1024;
+
+static thread_local std::vector<Buffer> t_pool;
+
+// Give pooled memory to a buffer that has none
+void buf_acquire(Buffer &buf) {
+  if (buf.capacity() == 0 && !t_pool.empty()) {
+    buf.swap(t_pool.back());
+    t_pool.pop_back();
+  }
+}
+
+// Drop the data and give the memory back to the pool
+void buf_release(Buffer &buf) {
+  if (buf.capacity() == 0) {
+    return;
+  }
+  buf.clear();
+  if (buf.capacity() <= k_pool_max_cap && t_pool.size() < k_pool_max_bufs) {
+    t_pool.push_back(std::move(buf));
+  } else {
+    Buffer().swap(buf);
+  }
+}
@@ -1,84 +1,213 @@
 #include "commands.h"
+#include "config.h"
+#include "defrag.h"
+#include "evict.h"
 #include "global_state.h"
+#include "mem_stats.h"
 #include "protocol.h"
+#include "shard.h"
 #include "shared.h"
+#include "slab.h"
 #include "storage.h"
 #include "timer.h"
 
+#include <algorithm>
 #include <cmath>
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string>
 
-void do_get(std::vector<std::string> &cmd, Buffer &out) {
+static std::string lower(std::string_view s) {
+  std::string out(s);
+  for (char &c : out) {
+    c = (char)tolower((unsigned char)c);
+  }
+  return out;
+}
+
+static void key_init(LookupKey &key, std::string_view name) {
+  key.key = name;
+  key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+}
+
+// the value of a string entry, large ones are referenced
+static void out_value(Buffer &out, Entry *ent) {
+  if (ent->enc == ENC_BLOB) {
+    return out_blob(out, ent->blob);
+  }
+  char buf[k_int_str_max];
+  std::string_view val = entry_str(ent, buf); // an integer is converted
+  return out_str(out, val.data(), val.size());
+}
+
+void do_get(std::vector<std::string_view> &cmd, Buffer &out) {
   // a dummy struct just for the lookup
   LookupKey key;
-  key.key.swap(cmd[1]);
-  key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+  key_init(key, cmd[1]);
   // hashtable lookup
   HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
   if (!node) {
     return out_nil(out);
   }
-  // copy the value
+  // copy or reference the value
   Entry *ent = container_of(node, Entry, node);
   if (ent->type != T_STR) {
     return out_err(out, ERR_BAD_TYP, "not a string value");
   }
-  return out_str(out, ent->str.data(), ent->str.size());
+  evict_touch(ent);
+  return out_value(out, ent);
 }
 
-void do_set(std::vector<std::string> &cmd, Buffer &out) {
-  // a dummy struct just for the lookup
-  LookupKey key;
-  key.key.swap(cmd[1]);
-  key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-  // hashtable lookup
-  HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+// store a string value, the entry is looked up if not given
+static void set_value(LookupKey &key, HNode *node, std::string_view val) {
   if (node) {
     // found, update the value
     Entry *ent = container_of(node, Entry, node);
-    if (ent->type != T_STR) {
-      return out_err(out, ERR_BAD_TYP, "a non-string value exists");
-    }
-    ent->str.swap(cmd[2]);
+    ent = entry_set_str(ent, val);
+    evict_touch(ent);
   } else {
     // not found, allocate & insert a new pair
-    Entry *ent = entry_new(T_STR);
-    ent->key.swap(key.key);
+    Entry *ent = entry_new(T_STR, key.key, val);
     ent->node.hcode = key.node.hcode;
-    ent->str.swap(cmd[2]);
     hm_insert(&g_data.db, &ent->node);
   }
-  return out_nil(out);
 }
 
-void do_del(std::vector<std::string> &cmd, Buffer &out) {
+void do_set(std::vector<std::string_view> &cmd, Buffer &out) {
   // a dummy struct just for the lookup
   LookupKey key;
-  key.key.swap(cmd[1]);
-  key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+  key_init(key, cmd[1]);
+  // hashtable lookup
+  HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+  if (node && container_of(node, Entry, node)->type != T_STR) {
+    return out_err(out, ERR_BAD_TYP, "a non-string value exists");
+  }
+  set_value(key, node, cmd[2]);
+  return out_nil(out);
+}
+
+static bool del_key(LookupKey &key) {
   // hashtable delete
   HNode *node = hm_delete(&g_data.db, &key.node, &entry_eq);
   if (node) { // deallocate the pair
     entry_del(container_of(node, Entry, node));
   }
-  return out_int(out, node ? 1 : 0);
+  return node != NULL;
+}
+
+// Lookup keys for the arguments first..end by `step`, hashed up front.
+// Reused by every multi-key command.
+static std::vector<LookupKey> &batch_keys(std::vector<std::string_view> &cmd,
+                                          size_t first, size_t step) {
+  static thread_local std::vector<LookupKey> keys;
+  keys.resize((cmd.size() - first) / step);
+  for (size_t i = 0; i < keys.size(); i++) {
+    key_init(keys[i], cmd[first + i * step]);
+  }
+  return keys;
+}
+
+// HNode pointers of the lookup keys, for the hm_* batch functions
+static HNode **batch_nodes(std::vector<LookupKey> &keys) {
+  static thread_local std::vector<HNode *> nodes;
+  nodes.resize(keys.size());
+  for (size_t i = 0; i < keys.size(); i++) {
+    nodes[i] = &keys[i].node;
+  }
+  return nodes.data();
+}
+
+// DEL key [key ...]
+void do_del(std::vector<std::string_view> &cmd, Buffer &out) {
+  std::vector<LookupKey> &keys = batch_keys(cmd, 1, 1);
+  HNode **nodes = batch_nodes(keys);
+  int64_t deleted = 0;
+  for (size_t base = 0; base < keys.size(); base += k_prefetch_group) {
+    size_t n = std::min(k_prefetch_group, keys.size() - base);
+    hm_prefetch(&g_data.db, &nodes[base], n);
+    for (size_t i = base; i < base + n; i++) {
+      deleted += del_key(keys[i]);
+    }
+  }
+  return out_int(out, deleted);
+}
+
+// MGET key [key ...]
+// The hashtable probes of all the keys overlap, then the values are read.
+// A key that isn't a string is nil.
+void do_mget(std::vector<std::string_view> &cmd, Buffer &out) {
+  static thread_local std::vector<HNode *> found;
+  std::vector<LookupKey> &keys = batch_keys(cmd, 1, 1);
+  found.resize(keys.size());
+  hm_lookup_many(&g_data.db, batch_nodes(keys), keys.size(), &entry_eq,
+                 found.data());
+
+  // small values are in the entries, already loaded by the lookups
+  for (HNode *node : found) {
+    Entry *ent = node ? container_of(node, Entry, node) : NULL;
+    if (ent && ent->type == T_STR && ent->enc == ENC_BLOB) {
+      __builtin_prefetch(ent->blob);
+    }
+  }
+  out_arr(out, (uint32_t)found.size());
+  for (HNode *node : found) {
+    Entry *ent = node ? container_of(node, Entry, node) : NULL;
+    if (ent && ent->type == T_STR) {
+      evict_touch(ent);
+      out_value(out, ent);
+    } else {
+      out_nil(out);
+    }
+  }
 }
 
-static bool str2int(const std::string &s, int64_t &out) {
+// MSET key value [key value ...]
+// Like SET for each pair, but values of other types are replaced.
+void do_mset(std::vector<std::string_view> &cmd, Buffer &out) {
+  if (cmd.size() % 2 == 0) {
+    return out_err(out, ERR_BAD_ARG, "wrong number of arguments.");
+  }
+  std::vector<LookupKey> &keys = batch_keys(cmd, 1, 2);
+  HNode **nodes = batch_nodes(keys);
+  for (size_t base = 0; base < keys.size(); base += k_prefetch_group) {
+    size_t n = std::min(k_prefetch_group, keys.size() - base);
+    hm_prefetch(&g_data.db, &nodes[base], n);
+    // looked up one at a time since a key can repeat
+    for (size_t i = base; i < base + n; i++) {
+      HNode *node = hm_lookup(&g_data.db, nodes[i], &entry_eq);
+      if (node && container_of(node, Entry, node)->type != T_STR) {
+        del_key(keys[i]);
+        node = NULL;
+      }
+      set_value(keys[i], node, cmd[2 + 2 * i]);
+    }
+  }
+  return out_nil(out);
+}
+
+// the whole argument must be a decimal int64, without spaces or a `+`, and
+// not out of range
+static bool str2int(std::string_view arg, int64_t &out) {
+  if (arg.empty() || !(isdigit((uint8_t)arg[0]) || arg[0] == '-')) {
+    return false;
+  }
+  std::string s(arg);
   char *endp = NULL;
+  errno = 0;
   out = strtoll(s.c_str(), &endp, 10);
-  return endp == s.c_str() + s.size();
+  return errno != ERANGE && endp == s.c_str() + s.size();
 }
 
 // PEXPIRE key ttl_ms
-void do_expire(std::vector<std::string> &cmd, Buffer &out) {
+void do_expire(std::vector<std::string_view> &cmd, Buffer &out) {
   int64_t ttl_ms = 0;
   if (!str2int(cmd[2], ttl_ms)) {
     return out_err(out, ERR_BAD_ARG, "expect int64");
   }
 
   LookupKey key;
-  key.key.swap(cmd[1]);
-  key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+  key_init(key, cmd[1]);
 
   HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
   if (node) {
@@ -89,10 +218,9 @@ void do_expire(std::vector<std::string> &cmd, Buffer &out) {
 }
 
 // PTTL key
-void do_ttl(std::vector<std::string> &cmd, Buffer &out) {
+void do_ttl(std::vector<std::string_view> &cmd, Buffer &out) {
   LookupKey key;
-  key.key.swap(cmd[1]);
-  key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+  key_init(key, cmd[1]);
 
   HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
   if (!node) {
@@ -100,35 +228,267 @@ void do_ttl(std::vector<std::string> &cmd, Buffer &out) {
   }
 
   Entry *ent = container_of(node, Entry, node);
-  if (ent->heap_idx == (size_t)-1) {
+  if (!tw_active(&ent->ttl)) {
     return out_int(out, -1); // no TTL
   }
 
-  uint64_t expire_at = g_data.heap[ent->heap_idx].val;
+  uint64_t expire_at = ent->ttl.expire_ms;
   uint64_t now_ms = get_monotonic_msec();
   return out_int(out, expire_at > now_ms ? (expire_at - now_ms) : 0);
 }
 
+// the string entry of a key, created if missing. NULL for another type.
+static Entry *string_entry(std::string_view name) {
+  LookupKey key;
+  key_init(key, name);
+  HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+  if (!node) {
+    Entry *ent = entry_new(T_STR, key.key, "0");
+    ent->node.hcode = key.node.hcode;
+    hm_insert(&g_data.db, &ent->node);
+    return ent;
+  }
+  Entry *ent = container_of(node, Entry, node);
+  evict_touch(ent);
+  return ent->type == T_STR ? ent : NULL;
+}
+
+// add to the integer value of a key, a missing key is 0
+static void incr_by(std::string_view name, int64_t delta, Buffer &out) {
+  Entry *ent = string_entry(name);
+  if (!ent) {
+    return out_err(out, ERR_BAD_TYP, "not a string value");
+  }
+  if (ent->enc != ENC_INT) {
+    return out_err(out, ERR_BAD_ARG, "value is not an integer");
+  }
+  int64_t val = 0;
+  if (__builtin_add_overflow(ent->ival, delta, &val)) {
+    return out_err(out, ERR_BAD_ARG, "increment would overflow");
+  }
+  ent->ival = val; // updated in place, the TTL is kept
+  return out_int(out, val);
+}
+
+// INCR key
+void do_incr(std::vector<std::string_view> &cmd, Buffer &out) {
+  return incr_by(cmd[1], 1, out);
+}
+
+// DECR key
+void do_decr(std::vector<std::string_view> &cmd, Buffer &out) {
+  return incr_by(cmd[1], -1, out);
+}
+
+// INCRBY key increment
+void do_incrby(std::vector<std::string_view> &cmd, Buffer &out) {
+  int64_t delta = 0;
+  if (!str2int(cmd[2], delta)) {
+    return out_err(out, ERR_BAD_ARG, "expect int64");
+  }
+  return incr_by(cmd[1], delta, out);
+}
+
+// DECRBY key decrement
+void do_decrby(std::vector<std::string_view> &cmd, Buffer &out) {
+  int64_t delta = 0;
+  if (!str2int(cmd[2], delta) || delta == INT64_MIN) {
+    return out_err(out, ERR_BAD_ARG, "expect int64");
+  }
+  return incr_by(cmd[1], -delta, out);
+}
+
+// a finite decimal float: no spaces, `+`, hex, inf or nan
+static bool str2ldbl(std::string_view arg, long double &out) {
+  std::string_view digits = arg.substr(!arg.empty() && arg[0] == '-');
+  if (digits.empty() || !(isdigit((uint8_t)digits[0]) || digits[0] == '.') ||
+      digits.find_first_of("xX") != digits.npos) {
+    return false;
+  }
+  std::string s(arg);
+  char *endp = NULL;
+  out = strtold(s.c_str(), &endp);
+  return endp == s.c_str() + s.size() && std::isfinite(out);
+}
+
+// INCRBYFLOAT key increment
+// The result is stored as a string, or as an integer if it's integral, and
+// returned as a string. Long doubles keep 0.1 + 0.2 printing as 0.3.
+void do_incrbyfloat(std::vector<std::string_view> &cmd, Buffer &out) {
+  long double delta = 0;
+  if (!str2ldbl(cmd[2], delta)) {
+    return out_err(out, ERR_BAD_ARG, "expect float");
+  }
+  Entry *ent = string_entry(cmd[1]);
+  if (!ent) {
+    return out_err(out, ERR_BAD_TYP, "not a string value");
+  }
+  char buf[64];
+  long double val = 0;
+  if (!str2ldbl(entry_str(ent, buf), val)) {
+    return out_err(out, ERR_BAD_ARG, "value is not a float");
+  }
+  val += delta;
+  if (!std::isfinite(val)) {
+    return out_err(out, ERR_BAD_ARG, "increment would produce NaN or Infinity");
+  }
+  int len = snprintf(buf, sizeof(buf), "%.17Lg", val);
+  entry_set_str(ent, std::string_view(buf, (size_t)len));
+  return out_str(out, buf, (size_t)len);
+}
+
 bool cb_keys(HNode *node, void *arg) {
   Buffer &out = *(Buffer *)arg;
-  const std::string &key = container_of(node, Entry, node)->key;
+  std::string_view key = entry_key(container_of(node, Entry, node));
   out_str(out, key.data(), key.size());
   return true;
 }
 
-void do_keys(std::vector<std::string> &, Buffer &out) {
+void do_keys(std::vector<std::string_view> &, Buffer &out) {
   out_arr(out, (uint32_t)hm_size(&g_data.db));
   hm_foreach(&g_data.db, &cb_keys, (void *)&out);
 }
 
-static bool str2dbl(const std::string &s, double &out) {
+// match one byte against the pattern item at `p`: a byte, ? for any byte,
+// a set like [abc], [a-z] or [^a], or \ and a byte. Moves `p` past it.
+static bool glob_byte(std::string_view pat, size_t &p, char ch) {
+  char c = pat[p++];
+  if (c == '?') {
+    return true;
+  }
+  if (c == '\\' && p < pat.size()) {
+    return pat[p++] == ch;
+  }
+  size_t end = c == '[' ? pat.find(']', p) : std::string_view::npos;
+  if (end == std::string_view::npos) {
+    return c == ch; // not a set
+  }
+  bool negate = p < end && pat[p] == '^';
+  p += negate;
+  bool hit = false;
+  for (; p < end; p++) {
+    if (pat[p] == '\\' && p + 1 < end) {
+      hit |= pat[++p] == ch;
+    } else if (p + 2 < end && pat[p + 1] == '-') {
+      uint8_t lo = (uint8_t)pat[p], hi = (uint8_t)pat[p + 2];
+      if (lo > hi) {
+        std::swap(lo, hi);
+      }
+      hit |= (uint8_t)ch >= lo && (uint8_t)ch <= hi;
+      p += 2;
+    } else {
+      hit |= pat[p] == ch;
+    }
+  }
+  p = end + 1;
+  return hit != negate;
+}
+
+// glob-style pattern match, * is any string.
+// A mismatch after a * retries with the * taking one more byte, earlier
+// stars don't need to be retried.
+static bool glob_match(std::string_view pat, std::string_view str) {
+  size_t p = 0, s = 0;
+  size_t star_p = std::string_view::npos, star_s = 0;
+  while (s < str.size()) {
+    if (p < pat.size() && pat[p] == '*') {
+      star_p = ++p;
+      star_s = s;
+      continue;
+    }
+    size_t next = p;
+    if (p < pat.size() && glob_byte(pat, next, str[s])) {
+      p = next;
+      s++;
+      continue;
+    }
+    if (star_p == std::string_view::npos) {
+      return false;
+    }
+    p = star_p;
+    s = ++star_s;
+  }
+  while (p < pat.size() && pat[p] == '*') {
+    p++;
+  }
+  return p == pat.size();
+}
+
+static void cb_scan(HNode *node, void *arg) {
+  auto &keys = *(std::vector<std::string_view> *)arg;
+  keys.push_back(entry_key(container_of(node, Entry, node)));
+}
+
+// SCAN cursor [MATCH pattern] [COUNT count]
+// Returns the next cursor, 0 when done, and the keys found from the given
+// one. Stops after COUNT keys (10 by default) or 10 times as many hashtable
+// positions, so each call does bounded work. MATCH filters the keys found.
+// With shards, the cursor goes through the shards one after another.
+const int64_t k_scan_count_max = 100000; // larger COUNTs are capped
+void do_scan(std::vector<std::string_view> &cmd, Buffer &out) {
+  int64_t cursor = 0;
+  if (!str2int(cmd[1], cursor) || cursor < 0 ||
+      (uint64_t)cursor >> k_cursor_shard_shift != g_data.shard->id) {
+    return out_err(out, ERR_BAD_ARG, "invalid cursor");
+  }
+  std::string_view pattern = "*";
+  int64_t count = 10;
+  for (size_t i = 2; i < cmd.size(); i += 2) {
+    std::string opt = lower(cmd[i]);
+    if (i + 1 == cmd.size()) {
+      return out_err(out, ERR_BAD_ARG, "syntax error");
+    } else if (opt == "match") {
+      pattern = cmd[i + 1];
+    } else if (opt == "count") {
+      if (!str2int(cmd[i + 1], count) || count < 1) {
+        return out_err(out, ERR_BAD_ARG, "expect positive int");
+      }
+    } else {
+      return out_err(out, ERR_BAD_ARG, "syntax error");
+    }
+  }
+
+  count = std::min(count, k_scan_count_max);
+
+  static thread_local std::vector<std::string_view> keys;
+  keys.clear();
+  const uint64_t pos_mask = ((uint64_t)1 << k_cursor_shard_shift) - 1;
+  uint64_t pos = (uint64_t)cursor & pos_mask;
+  uint64_t limit = (uint64_t)count * 10;
+  do {
+    pos = hm_scan(&g_data.db, pos, &cb_scan, &keys);
+  } while (pos && keys.size() < (uint64_t)count && --limit);
+
+  uint64_t shard = g_data.shard->id;
+  if (!pos && shard + 1 < g_shards.size()) {
+    shard++; // continue with the next shard
+  } else if (!pos) {
+    shard = 0; // done
+  }
+  if (pattern != "*") {
+    auto end = std::remove_if(
+        keys.begin(), keys.end(),
+        [&](std::string_view k) { return !glob_match(pattern, k); });
+    keys.erase(end, keys.end());
+  }
+  std::string next = std::to_string(shard << k_cursor_shard_shift | pos);
+  out_arr(out, 2);
+  out_str(out, next.data(), next.size());
+  out_arr(out, (uint32_t)keys.size());
+  for (std::string_view k : keys) {
+    out_str(out, k.data(), k.size());
+  }
+}
+
+static bool str2dbl(std::string_view arg, double &out) {
+  std::string s(arg);
   char *endp = NULL;
   out = strtod(s.c_str(), &endp);
   return endp == s.c_str() + s.size() && !std::isnan(out);
 }
 
 // zadd zset score name
-void do_zadd(std::vector<std::string> &cmd, Buffer &out) {
+void do_zadd(std::vector<std::string_view> &cmd, Buffer &out) {
   double score = 0;
   if (!str2dbl(cmd[2], score)) {
     return out_err(out, ERR_BAD_ARG, "expect float");
@@ -136,14 +496,12 @@ void do_zadd(std::vector<std::string> &cmd, Buffer &out) {
 
   // look up or create the zset
   LookupKey key;
-  key.key.swap(cmd[1]);
-  key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+  key_init(key, cmd[1]);
   HNode *hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
 
   Entry *ent = NULL;
   if (!hnode) { // insert a new key
-    ent = entry_new(T_ZSET);
-    ent->key.swap(key.key);
+    ent = entry_new(T_ZSET, key.key, {});
     ent->node.hcode = key.node.hcode;
     hm_insert(&g_data.db, &ent->node);
   } else { // check the existing key
@@ -151,49 +509,52 @@ void do_zadd(std::vector<std::string> &cmd, Buffer &out) {
     if (ent->type != T_ZSET) {
       return out_err(out, ERR_BAD_TYP, "expect zset");
     }
+    evict_touch(ent);
   }
 
   // add or update the tuple
-  const std::string &name = cmd[3];
-  bool added = zset_insert(&ent->zset, name.data(), name.size(), score);
+  std::string_view name = cmd[3];
+  bool added = zset_insert(ent->zset, name.data(), name.size(), score);
+  zset_track_rehash(ent->zset);
   return out_int(out, (int64_t)added);
 }
 
 // zrem zset name
-void do_zrem(std::vector<std::string> &cmd, Buffer &out) {
+void do_zrem(std::vector<std::string_view> &cmd, Buffer &out) {
   ZSet *zset = expect_zset(cmd[1]);
   if (!zset) {
     return out_err(out, ERR_BAD_TYP, "expect zset");
   }
 
-  const std::string &name = cmd[2];
-  ZNode *znode = zset_lookup(zset, name.data(), name.size());
-  if (znode) {
-    zset_delete(zset, znode);
+  std::string_view name = cmd[2];
+  bool deleted = zset_delete(zset, name.data(), name.size());
+  if (deleted) {
+    zset_track_rehash(zset);
   }
-  return out_int(out, znode ? 1 : 0);
+  return out_int(out, deleted ? 1 : 0);
 }
 
 // zscore zset name
-void do_zscore(std::vector<std::string> &cmd, Buffer &out) {
+void do_zscore(std::vector<std::string_view> &cmd, Buffer &out) {
   ZSet *zset = expect_zset(cmd[1]);
   if (!zset) {
     return out_err(out, ERR_BAD_TYP, "expect zset");
   }
 
-  const std::string &name = cmd[2];
-  ZNode *znode = zset_lookup(zset, name.data(), name.size());
-  return znode ? out_dbl(out, znode->score) : out_nil(out);
+  std::string_view name = cmd[2];
+  double score = 0;
+  bool found = zset_lookup(zset, name.data(), name.size(), score);
+  return found ? out_dbl(out, score) : out_nil(out);
 }
 
 // zquery zset score name offset limit
-void do_zquery(std::vector<std::string> &cmd, Buffer &out) {
+void do_zquery(std::vector<std::string_view> &cmd, Buffer &out) {
   // parse args
   double score = 0;
   if (!str2dbl(cmd[2], score)) {
     return out_err(out, ERR_BAD_ARG, "expect fp number");
   }
-  const std::string &name = cmd[3];
+  std::string_view name = cmd[3];
   int64_t offset = 0, limit = 0;
   if (!str2int(cmd[4], offset) || !str2int(cmd[5], limit)) {
     return out_err(out, ERR_BAD_ARG, "expect int");
@@ -209,17 +570,245 @@ void do_zquery(std::vector<std::string> &cmd, Buffer &out) {
   if (limit <= 0) {
     return out_arr(out, 0);
   }
-  ZNode *znode = zset_seekge(zset, score, name.data(), name.size());
-  znode = znode_offset(znode, offset);
+  ZPos pos = zset_seekge(zset, score, name.data(), name.size());
+  pos = znode_offset(zset, pos, offset);
 
   // output
   size_t ctx = out_begin_arr(out);
   int64_t n = 0;
-  while (znode && n < limit) {
-    out_str(out, znode->name, znode->len);
-    out_dbl(out, znode->score);
-    znode = znode_offset(znode, +1);
+  double mscore = 0;
+  std::string_view mname;
+  while (n < limit && zpos_member(pos, mscore, mname)) {
+    out_str(out, mname.data(), mname.size());
+    out_dbl(out, mscore);
+    pos = znode_offset(zset, pos, +1);
     n += 2;
   }
   out_end_arr(out, ctx, (uint32_t)n);
 }
+
+static void out_line(Buffer &out, const std::string &line) {
+  out_str(out, line.data(), line.size());
+}
+
+static void out_field(Buffer &out, const char *name, int64_t val) {
+  out_line(out, std::string(name) + ":" + std::to_string(val));
+}
+
+// INFO [section]
+// An array of lines, "# Section" headers followed by "name:value" fields.
+// Every shard appends its own lines. The memory counters are for the whole
+// process, only the 1st shard reports them.
+void do_info(std::vector<std::string_view> &cmd, Buffer &out) {
+  std::string section = cmd.size() > 1 ? lower(cmd[1]) : "all";
+
+  size_t ctx = out_begin_arr(out);
+  uint32_t n = 0;
+  if ((section == "all" || section == "memory") && g_data.shard->id == 0) {
+    static const char *const names[MEM_COUNT] = {
+        "mem_entries", "mem_values", "mem_zsets", "mem_hashtables",
+        "mem_buffers",
+    };
+    int64_t bytes[MEM_COUNT];
+    int64_t used = 0;
+    for (uint32_t i = 0; i < MEM_COUNT; i++) {
+      bytes[i] = mem_total(i);
+      used += bytes[i];
+    }
+    out_line(out, "# Memory");
+    out_field(out, "used_memory", used);
+    out_field(out, "used_memory_rss", (int64_t)mem_rss());
+    for (uint32_t i = 0; i < MEM_COUNT; i++) {
+      out_field(out, names[i], bytes[i]);
+    }
+    // the timing wheels are fixed size, the timers are in the entries
+    size_t wheels = sizeof(TimingWheel) * g_shards.size();
+    out_field(out, "mem_ttl_wheels", (int64_t)wheels);
+    // the entries and sorted set nodes are in slab pages
+    SlabStats slab = slab_stats();
+    out_field(out, "slab_pages", slab.pages);
+    out_field(out, "slab_used", slab.used);
+    out_field(out, "defrag_moved", (int64_t)defrag_moved());
+    out_field(out, "maxmemory", (int64_t)g_config.maxmemory);
+    out_line(out, std::string("maxmemory_policy:") +
+                      evict_policy_name(g_config.maxmemory_policy));
+    out_field(out, "evicted_keys", (int64_t)evict_count());
+    n += 10 + MEM_COUNT;
+  }
+  if (section == "all" || section == "commandstats") {
+    out_line(out, "# Commandstats");
+    n++;
+    if (g_shards.size() > 1) {
+      out_line(out, "shard:" + std::to_string(g_data.shard->id));
+      n++;
+    }
+    for (uint32_t id = 0; id < CMD_COUNT; id++) {
+      const CommandStats &st = g_data.cmd_stats[id];
+      if (!st.calls && !st.rejected) {
+        continue;
+      }
+      out_line(out, std::string("cmdstat_") + k_commands[id].name +
+                        ":calls=" + std::to_string(st.calls) +
+                        ",rejected_calls=" + std::to_string(st.rejected));
+      n++;
+    }
+  }
+  out_end_arr(out, ctx, n);
+}
+
+// MEMORY USAGE key
+// The bytes allocated for a key and its value, nil if it doesn't exist
+void do_memory(std::vector<std::string_view> &cmd, Buffer &out) {
+  if (lower(cmd[1]) != "usage" || cmd.size() != 3) {
+    return out_err(out, ERR_BAD_ARG, "expect MEMORY USAGE key");
+  }
+  LookupKey key;
+  key_init(key, cmd[2]);
+  HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+  if (!node) {
+    return out_nil(out);
+  }
+  return out_int(out, (int64_t)entry_mem(container_of(node, Entry, node)));
+}
+
+// PING [message]
+void do_ping(std::vector<std::string_view> &cmd, Buffer &out) {
+  if (cmd.size() > 2) {
+    return out_err(out, ERR_BAD_ARG, "wrong number of arguments.");
+  }
+  if (cmd.size() == 2) {
+    return out_str(out, cmd[1].data(), cmd[1].size());
+  }
+  return out_status(out, "PONG");
+}
+
+// HELLO [protover [...]]
+// Switches a RESP connection to RESP2 or RESP3, the options are ignored.
+void do_hello(std::vector<std::string_view> &cmd, Buffer &out) {
+  if (g_data.proto == PROTO_BIN) {
+    return out_err(out, ERR_UNKNOWN, "HELLO needs a RESP connection.");
+  }
+  if (cmd.size() > 1) {
+    if (cmd[1] == "2") {
+      g_data.proto = PROTO_RESP2;
+    } else if (cmd[1] == "3") {
+      g_data.proto = PROTO_RESP3;
+    } else {
+      return out_err(out, ERR_BAD_ARG, "unsupported protocol version.");
+    }
+  }
+  // the reply is already in the new protocol
+  out_map(out, 6);
+  out_status(out, "server");
+  out_status(out, "redis-clone");
+  out_status(out, "version");
+  out_status(out, "1.0.0");
+  out_status(out, "proto");
+  out_int(out, g_data.proto == PROTO_RESP3 ? 3 : 2);
+  out_status(out, "mode");
+  out_status(out, "standalone");
+  out_status(out, "role");
+  out_status(out, "master");
+  out_status(out, "modules");
+  out_arr(out, 0);
+}
+
+// The command table, indexed by the CMD_* ids
+const Command k_commands[CMD_COUNT] = {
+    // name, handler, arity, flags, first key, last key, key step
+    {"get", do_get, 2, CMD_READ, 1, 1, 1},
+    {"set", do_set, 3, CMD_WRITE | CMD_DENYOOM, 1, 1, 1},
+    {"del", do_del, -2, CMD_WRITE, 1, -1, 1},
+    {"pexpire", do_expire, 3, CMD_WRITE, 1, 1, 1},
+    {"pttl", do_ttl, 2, CMD_READ, 1, 1, 1},
+    {"keys", do_keys, 1, CMD_READ | CMD_ALL_SHARDS, 0, 0, 0},
+    {"zadd", do_zadd, 4, CMD_WRITE | CMD_DENYOOM, 1, 1, 1},
+    {"zrem", do_zrem, 3, CMD_WRITE, 1, 1, 1},
+    {"zscore", do_zscore, 3, CMD_READ, 1, 1, 1},
+    {"zquery", do_zquery, 6, CMD_READ, 1, 1, 1},
+    {"info", do_info, -1, CMD_READ | CMD_ALL_SHARDS, 0, 0, 0},
+    {"ping", do_ping, -1, 0, 0, 0, 0},
+    {"hello", do_hello, -1, 0, 0, 0, 0},
+    {"mget", do_mget, -2, CMD_READ, 1, -1, 1},
+    {"mset", do_mset, -3, CMD_WRITE | CMD_DENYOOM, 1, -1, 2},
+    {"mdel", do_del, -2, CMD_WRITE, 1, -1, 1},
+    {"scan", do_scan, -2, CMD_READ | CMD_CURSOR, 0, 0, 0},
+    {"incr", do_incr, 2, CMD_WRITE | CMD_DENYOOM, 1, 1, 1},
+    {"decr", do_decr, 2, CMD_WRITE | CMD_DENYOOM, 1, 1, 1},
+    {"incrby", do_incrby, 3, CMD_WRITE | CMD_DENYOOM, 1, 1, 1},
+    {"decrby", do_decrby, 3, CMD_WRITE | CMD_DENYOOM, 1, 1, 1},
+    {"incrbyfloat", do_incrbyfloat, 3, CMD_WRITE | CMD_DENYOOM, 1, 1, 1},
+    {"memory", do_memory, -2, CMD_READ, 2, 2, 1},
+};
+
+// Case-insensitive compare with the name of a command of the same length.
+// The names only have letters, so setting bit 5 lowers the case.
+static const Command *match(std::string_view name, uint32_t id) {
+  const char *want = k_commands[id].name;
+  for (size_t i = 0; i < name.size(); i++) {
+    if ((name[i] | 0x20) != want[i]) {
+      return NULL;
+    }
+  }
+  return &k_commands[id];
+}
+
+// Dispatch on the length and the first distinct byte, then confirm with a
+// single compare. The cost doesn't grow with the number of commands.
+const Command *command_lookup(std::string_view name) {
+  if (name.size() < 3) {
+    return NULL;
+  }
+  char c0 = name[0] | 0x20;
+  char c1 = name[1] | 0x20;
+  switch (name.size()) {
+  case 3:
+    switch (c0) {
+    case 'g': return match(name, CMD_GET);
+    case 's': return match(name, CMD_SET);
+    case 'd': return match(name, CMD_DEL);
+    }
+    break;
+  case 4:
+    switch (c0) {
+    case 'p': return match(name, c1 == 't' ? CMD_PTTL : CMD_PING);
+    case 'k': return match(name, CMD_KEYS);
+    case 'i': return match(name, (name[2] | 0x20) == 'c' ? CMD_INCR : CMD_INFO);
+    case 'd': return match(name, CMD_DECR);
+    case 's': return match(name, CMD_SCAN);
+    case 'm':
+      switch (c1) {
+      case 'g': return match(name, CMD_MGET);
+      case 's': return match(name, CMD_MSET);
+      case 'd': return match(name, CMD_MDEL);
+      }
+      break;
+    case 'z': return match(name, c1 == 'a' ? CMD_ZADD : CMD_ZREM);
+    }
+    break;
+  case 5:
+    if (c0 == 'h') {
+      return match(name, CMD_HELLO);
+    }
+    break;
+  case 6:
+    switch (c0) {
+    case 'z': return match(name, c1 == 's' ? CMD_ZSCORE : CMD_ZQUERY);
+    case 'i': return match(name, CMD_INCRBY);
+    case 'd': return match(name, CMD_DECRBY);
+    case 'm': return match(name, CMD_MEMORY);
+    }
+    break;
+  case 7:
+    if (c0 == 'p') {
+      return match(name, CMD_PEXPIRE);
+    }
+    break;
+  case 11:
+    if (c0 == 'i') {
+      return match(name, CMD_INCRBYFLOAT);
+    }
+    break;
+  }
+  return NULL;
+}
@@ -1,54 +1,53 @@
 #include "connection_manager.h"
+#include "config.h"
 #include "protocol.h"
+#include "shard.h"
 #include "shared.h"
 #include "timer.h"
-#include <arpa/inet.h>
 #include <cassert>
-#include <fcntl.h>
-#include <netinet/ip.h>
-#include <poll.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
-// set the fd to nonblocking mode
-static void fd_set_nb(int fd) {
-  errno = 0;
-  int flags = fcntl(fd, F_GETFL, 0);
-  if (errno) {
-    die("fcntl error");
-    return;
-  }
-
-  flags |= O_NONBLOCK;
+// Accept the pending connections, returns the number accepted
+int32_t handle_accept(int fd) {
+  // Drain the backlog, but a bounded number at a time so that a reconnect
+  // storm doesn't starve the established connections. The listening socket
+  // stays ready if there are more.
+  const int32_t k_accept_batch = 256;
+  int32_t n = 0;
+  while (n < k_accept_batch) {
+    int connfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (connfd < 0 && (errno == EINTR || errno == ECONNABORTED)) {
+      continue;
+    }
+    if (connfd < 0) {
+      if (errno != EAGAIN) {
+        msg_errno("accept() error");
+      }
+      break;
+    }
 
-  errno = 0;
-  (void)fcntl(fd, F_SETFL, flags);
-  if (errno) {
-    die("fcntl error");
+    Conn *conn = conn_new(connfd);
+    conn->ev_flags = EV_READ;
+    ev_add(&g_data.loop, connfd, conn->ev_flags);
+    n++;
   }
+  return n;
 }
 
-// Accept a new connection
-int32_t handle_accept(int fd) {
-  // Accept
-  struct sockaddr_in client_addr = {};
-  socklen_t socklen = sizeof(client_addr);
-  int connfd = accept(fd, (struct sockaddr *)&client_addr, &socklen);
-  if (connfd < 0) {
-    msg_errno("accept() error");
-    return -1;
+// Create a `struct Conn` for an accepted socket
+Conn *conn_new(int connfd) {
+  Conn *conn = NULL;
+  if (!g_data.free_conns.empty()) {
+    conn = g_data.free_conns.back();
+    g_data.free_conns.pop_back();
+  } else {
+    conn = new Conn();
+    mem_add(MEM_BUFFERS, sizeof(Conn)); // never freed, see conn_free()
   }
-
-  uint32_t ip = client_addr.sin_addr.s_addr;
-  fprintf(stderr, "new client from %u.%u.%u.%u:%u\n", ip & 255, (ip >> 8) & 255,
-          (ip >> 16) & 255, ip >> 24, ntohs(client_addr.sin_port));
-
-  // Set the new connection fd to nonblocking mode
-  fd_set_nb(connfd);
-
-  // Create a `struct Conn`
-  Conn *conn = new Conn();
   conn->fd = connfd;
   conn->want_read = true;
   conn->last_active_ms = get_monotonic_msec();
@@ -60,32 +59,145 @@ int32_t handle_accept(int fd) {
   }
   assert(!g_data.fd2conn[conn->fd]);
   g_data.fd2conn[conn->fd] = conn;
-
-  return 0;
+  return conn;
 }
 
 // Destroy a connection
 void conn_destroy(Conn *conn) {
+  dlist_detach(&conn->idle_node);
+  conn->want_close = true;
+  if (conn_busy(conn)) {
+    // In-flight io_uring operations or requests forwarded to other shards
+    // still point to the conn. Shut down the socket so that the I/O
+    // completes, the last completion or reply frees the conn.
+    if (g_config.backend != EV_BACKEND_URING) {
+      ev_del(&g_data.loop, conn->fd);
+    }
+    (void)shutdown(conn->fd, SHUT_RDWR);
+    return;
+  }
+  conn_free(conn);
+}
+
+// Whether something other than the event loop still references the conn
+bool conn_busy(Conn *conn) {
+  return conn->uring_ops > 0 || conn->remote_pending > 0;
+}
+
+// Release a connection that is no longer in the idle list
+void conn_free(Conn *conn) {
+  if (g_config.backend != EV_BACKEND_URING) {
+    ev_del(&g_data.loop, conn->fd);
+  }
   (void)close(conn->fd);
   g_data.fd2conn[conn->fd] = NULL;
+
+  // The socket is gone, nobody will see what the kernel still sends
+  if (ZeroCopy *zc = conn->zc) {
+    for (const ZeroCopy::Held &held : zc->held) {
+      blob_unref(held.blob);
+    }
+    delete zc;
+  }
+
+  // Keep the object for the next connection, the pool only grows to the
+  // peak number of connections
+  buf_release(conn->incoming);
+  buf_release(conn->outgoing);
+  buf_release(conn->sending);
+  *conn = Conn();
+  g_data.free_conns.push_back(conn);
+}
+
+// Give the memory of the empty buffers back to the pool
+void conn_trim(Conn *conn) {
+  if (conn->incoming.empty()) {
+    buf_release(conn->incoming);
+  }
+  // the split requests of a deep pipeline
+  const size_t k_parsed_keep = 64;
+  if (conn->parsed.empty() && conn->parsed.capacity() > k_parsed_keep) {
+    conn->parsed = std::vector<ConnReq>();
+    conn->parsed_args = std::vector<ConnArg>();
+  }
+  if (conn->outgoing.empty()) {
+    buf_release(conn->outgoing);
+  }
+  if (conn->sending.empty()) {
+    buf_release(conn->sending);
+  }
+}
+
+// Update the idle timer by moving conn to the end of the list
+void conn_touch(Conn *conn) {
+  conn->last_active_ms = get_monotonic_msec();
   dlist_detach(&conn->idle_node);
-  delete conn;
+  dlist_insert_before(&g_data.idle_list, &conn->idle_node);
 }
 
-// Handle read events
-void handle_read(Conn *conn) {
-  // Read some data
-  uint8_t buf[64 * 1024];
-  ssize_t rv = read(conn->fd, buf, sizeof(buf));
+// Tell the event loop about changes in the application's intention
+void conn_update_events(Conn *conn) {
+  uint32_t flags = 0;
+  if (conn->want_read) {
+    flags |= EV_READ;
+  }
+  if (conn->want_write) {
+    flags |= EV_WRITE;
+  }
+  if (flags != conn->ev_flags) {
+    ev_mod(&g_data.loop, conn->fd, flags);
+    conn->ev_flags = flags;
+  }
+}
+
+// Continue a connection after the replies from other shards
+void conn_resume(Conn *conn) {
+  if (conn->want_close) {
+    if (!conn_busy(conn)) {
+      conn_free(conn); // destroyed while waiting
+    }
+    return;
+  }
+
+  // Process the pipelined requests that were waiting for the reply
+  while (try_one_request(conn))
+    ;
+  if (conn->want_close) {
+    return conn_destroy(conn);
+  }
+
+  if (g_config.backend == EV_BACKEND_URING) {
+    return uring_send(&g_data.ring, conn);
+  }
+  if (!conn->outgoing.empty()) {
+    conn->want_read = false;
+    conn->want_write = true;
+    handle_write(conn);
+  }
+  if (conn->want_close) {
+    return conn_destroy(conn);
+  }
+  conn_trim(conn);
+  conn_update_events(conn);
+}
+
+// Read what is available into the incoming buffer
+bool conn_read(Conn *conn) {
+  // Read some data straight into the free tail of the buffer
+  const size_t k_read_size = 16 * 1024;
+  buf_acquire(conn->incoming);
+  buf_reserve(conn->incoming, k_read_size);
+  ssize_t rv = read(conn->fd, buf_tail(conn->incoming),
+                    buf_tail_size(conn->incoming));
 
   if (rv < 0 && errno == EAGAIN) {
-    return; // Actually not ready
+    return false; // Actually not ready
   }
 
   if (rv < 0) {
     msg_errno("read() error");
     conn->want_close = true;
-    return; // Want close
+    return false; // Want close
   }
 
   // Handle EOF
@@ -96,18 +208,25 @@ void handle_read(Conn *conn) {
       msg("unexpected EOF");
     }
     conn->want_close = true;
-    return; // Want close
+    return false; // Want close
   }
 
-  // Append to the incoming buffer
-  buf_append(conn->incoming, buf, (size_t)rv);
+  buf_advance(conn->incoming, (size_t)rv);
+  return true;
+}
+
+// Handle read events
+void handle_read(Conn *conn) {
+  if (!conn_read(conn)) {
+    return;
+  }
 
   // Keep processing requests until there is not enough data
   while (try_one_request(conn))
     ;
 
   // Update the readiness intention if a response is ready
-  if (conn->outgoing.size() > 0) {
+  if (!conn->outgoing.empty()) {
     conn->want_read = false;
     conn->want_write = true;
     // The socket is likely ready to write in a request-response protocol,
@@ -118,12 +237,103 @@ void handle_read(Conn *conn) {
   } // Else: want read
 }
 
+// Send a large value with MSG_ZEROCOPY. The kernel reads the value's
+// memory after send() returns, so the value is kept alive until the
+// completion is read from the socket's error queue.
+static ssize_t send_zerocopy(Conn *conn, const struct iovec &iov, Blob *blob) {
+  if (!conn->zc) {
+    conn->zc = new ZeroCopy();
+    int val = 1;
+    if (setsockopt(conn->fd, SOL_SOCKET, SO_ZEROCOPY, &val, sizeof(val))) {
+      conn->zc->disabled = true; // not supported by the socket
+    }
+  }
+  if (!conn->zc->disabled) {
+    ssize_t rv = send(conn->fd, iov.iov_base, iov.iov_len,
+                      MSG_ZEROCOPY | MSG_NOSIGNAL);
+    if (rv >= 0) {
+      blob_ref(blob);
+      conn->zc->held.push_back(ZeroCopy::Held{conn->zc->next_seq++, blob});
+      return rv;
+    }
+    if (errno != ENOBUFS) {
+      return rv;
+    }
+    // out of pinned memory, copy this time
+  }
+  return write(conn->fd, iov.iov_base, iov.iov_len);
+}
+
+// Read the MSG_ZEROCOPY completions from the error queue
+static void reap_zerocopy(Conn *conn) {
+  ZeroCopy *zc = conn->zc;
+  while (true) {
+    char control[128];
+    struct msghdr mh = {};
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+    if (recvmsg(conn->fd, &mh, MSG_ERRQUEUE) < 0) {
+      return; // Drained
+    }
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&mh); cm;
+         cm = CMSG_NXTHDR(&mh, cm)) {
+      bool recverr = (cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                     (cm->cmsg_level == SOL_IPV6 &&
+                      cm->cmsg_type == IPV6_RECVERR);
+      if (!recverr) {
+        continue;
+      }
+      struct sock_extended_err *err =
+          (struct sock_extended_err *)CMSG_DATA(cm);
+      if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+        continue;
+      }
+      // Sends [ee_info, ee_data] are done, they complete in order
+      while (!zc->held.empty() &&
+             (int32_t)(zc->held.front().seq - err->ee_data) <= 0) {
+        blob_unref(zc->held.front().blob);
+        zc->held.pop_front();
+      }
+    }
+  }
+}
+
+// Whether an error event is a real socket error, rather than MSG_ZEROCOPY
+// completions waiting in the error queue
+bool conn_sock_error(Conn *conn) {
+  if (!conn->zc) {
+    return true;
+  }
+  reap_zerocopy(conn);
+  int err = 0;
+  socklen_t len = sizeof(err);
+  getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+  return err != 0;
+}
+
 // Handle write events
 void handle_write(Conn *conn) {
-  assert(conn->outgoing.size() > 0);
+  assert(!conn->outgoing.empty());
 
-  // Write some data (might not write all)
-  ssize_t rv = write(conn->fd, &conn->outgoing[0], conn->outgoing.size());
+  // Write some data (might not write all). Large values are referenced by
+  // the buffer and written from the keyspace without copying.
+  const size_t k_max_iov = 64;
+  struct iovec iov[k_max_iov];
+  Blob *blobs[k_max_iov];
+  size_t n = buf_iov(conn->outgoing, iov, blobs, k_max_iov);
+  ssize_t rv = 0;
+  size_t zc_min = g_config.zerocopy;
+  if (zc_min && blobs[0] && iov[0].iov_len >= zc_min) {
+    rv = send_zerocopy(conn, iov[0], blobs[0]);
+  } else {
+    // Stop before a value to be sent with MSG_ZEROCOPY
+    for (size_t i = 1; zc_min && i < n; i++) {
+      if (blobs[i] && iov[i].iov_len >= zc_min) {
+        n = i;
+      }
+    }
+    rv = writev(conn->fd, iov, (int)n);
+  }
 
   if (rv < 0 && errno == EAGAIN) {
     return; // Actually not ready
@@ -139,49 +349,181 @@ void handle_write(Conn *conn) {
   buf_consume(conn->outgoing, (size_t)rv);
 
   // Update the readiness intention if all data written
-  if (conn->outgoing.size() == 0) {
+  if (conn->outgoing.empty()) {
     conn->want_read = true;
     conn->want_write = false;
+    if (conn->close_after_reply) {
+      conn->want_close = true; // the protocol error is sent
+    }
   } // Else: want write
 }
 
-// Process one request if there is enough data
-bool try_one_request(Conn *conn) {
+// Parse one request from the incoming buffer, at `from`. The request stays
+// in the buffer since the arguments point into it, `len` bytes are consumed
+// once it has been executed.
+// Returns 1 on success, 0 if there is not enough data, -1 on error.
+int32_t conn_parse(Conn *conn, size_t from,
+                   std::vector<std::string_view> &cmd, size_t *len_out) {
+  if (conn->proto == PROTO_NONE) {
+    conn->proto = sniff_proto(conn->incoming.data(), conn->incoming.size());
+  }
+  if (conn->proto == PROTO_NONE) {
+    return 0; // Want read
+  }
+  if (conn->proto != PROTO_BIN) {
+    int32_t rv = 0;
+    size_t skipped = 0; // empty requests behind pending ones
+    while (true) {
+      size_t at = from + skipped;
+      rv = parse_resp(conn->incoming.data() + at, conn->incoming.size() - at,
+                      cmd, len_out);
+      if (rv <= 0 || !cmd.empty()) {
+        break;
+      }
+      // Skip empty requests
+      if (from == 0) {
+        buf_consume(conn->incoming, *len_out);
+      } else {
+        skipped += *len_out;
+      }
+    }
+    if (rv < 0) {
+      msg("bad request");
+    }
+    *len_out += skipped;
+    return rv;
+  }
+
   // Try to parse the protocol: message header
-  if (conn->incoming.size() < 4) {
-    return false; // Want read
+  if (conn->incoming.size() - from < 4) {
+    return 0; // Want read
   }
 
   uint32_t len = 0;
-  memcpy(&len, conn->incoming.data(), 4);
+  memcpy(&len, &conn->incoming[from], 4);
   if (len > k_max_msg) {
     msg("too long");
-    conn->want_close = true;
-    return false; // Want close
+    return -1; // Want close
   }
 
   // Message body
-  if (4 + len > conn->incoming.size()) {
-    return false; // Want read
+  if (4 + len > conn->incoming.size() - from) {
+    return 0; // Want read
   }
 
-  const uint8_t *request = &conn->incoming[4];
-
-  // Got one request, do some application logic
-  std::vector<std::string> cmd;
+  const uint8_t *request = &conn->incoming[from + 4];
   if (parse_req(request, len, cmd) < 0) {
     msg("bad request");
-    conn->want_close = true;
-    return false; // Want close
+    return -1; // Want close
+  }
+
+  *len_out = 4 + (size_t)len;
+  return 1;
+}
+
+// I/O thread: split the complete requests of the incoming buffer, for
+// the loop thread to execute
+void conn_split(Conn *conn) {
+  // reused across calls
+  static thread_local std::vector<std::string_view> cmd;
+  while (true) {
+    size_t len = 0;
+    if (conn_parse(conn, conn->parsed_bytes, cmd, &len) <= 0) {
+      break; // Want read, an error is rejected in order by the loop thread
+    }
+    const char *start =
+        (const char *)conn->incoming.data() + conn->parsed_bytes;
+    for (std::string_view arg : cmd) {
+      ConnArg a;
+      a.off = (uint32_t)(arg.data() - start);
+      a.len = (uint32_t)arg.size();
+      conn->parsed_args.push_back(a);
+    }
+    ConnReq req;
+    req.len = len;
+    req.argc = (uint32_t)cmd.size();
+    conn->parsed.push_back(req);
+    conn->parsed_bytes += len;
   }
+}
+
+// The next request split by an I/O thread, if any
+static bool take_split(Conn *conn, std::vector<std::string_view> &cmd,
+                       size_t *len) {
+  if (conn->parsed_head == conn->parsed.size()) {
+    return false;
+  }
+  const ConnReq &req = conn->parsed[conn->parsed_head++];
+  const char *start = (const char *)conn->incoming.data();
+  cmd.clear();
+  for (uint32_t i = 0; i < req.argc; i++) {
+    const ConnArg &a = conn->parsed_args[conn->parsed_args_head++];
+    cmd.emplace_back(start + a.off, a.len);
+  }
+  *len = req.len;
+  conn->parsed_bytes -= req.len;
+  if (conn->parsed_head == conn->parsed.size()) {
+    conn->parsed.clear();
+    conn->parsed_args.clear();
+    conn->parsed_head = conn->parsed_args_head = 0;
+  }
+  return true;
+}
 
+// A request that can't be parsed closes the connection. A RESP client gets
+// an error reply first, after the replies of the requests before it.
+static void conn_reject(Conn *conn) {
+  if (conn->proto == PROTO_BIN) {
+    conn->want_close = true;
+    return;
+  }
+  g_data.proto = conn->proto;
+  buf_acquire(conn->outgoing);
   size_t header_pos = 0;
   response_begin(conn->outgoing, &header_pos);
-  do_request(cmd, conn->outgoing);
+  out_err(conn->outgoing, ERR_BAD_ARG,
+          "Protocol error: invalid or too big request");
   response_end(conn->outgoing, header_pos);
+  conn->close_after_reply = true;
+}
+
+// Process one request if there is enough data
+bool try_one_request(Conn *conn) {
+  // Keep the order of responses, wait for the reply from another shard
+  if (conn->remote_pending || conn->close_after_reply) {
+    return false;
+  }
 
-  // Application logic done! Remove the request message.
-  buf_consume(conn->incoming, 4 + len);
+  // Got one request, split already or parsed here
+  std::vector<std::string_view> &cmd = g_data.args;
+  size_t len = 0;
+  if (!take_split(conn, cmd, &len)) {
+    int32_t rv = conn_parse(conn, 0, cmd, &len);
+    if (rv < 0) {
+      conn_reject(conn);
+    }
+    if (rv <= 0) {
+      return false; // Want read or close
+    }
+  }
+
+  // Let the shard owning the key execute it, it gets a copy
+  g_data.proto = conn->proto;
+  const Command *c = cmd.empty() ? NULL : command_lookup(cmd[0]);
+  if (shard_forward(conn, c, cmd)) {
+    buf_consume(conn->incoming, len);
+    return !conn->remote_pending; // Want the reply, unless refused here
+  }
+
+  // Application logic
+  buf_acquire(conn->outgoing);
+  size_t header_pos = 0;
+  response_begin(conn->outgoing, &header_pos);
+  do_request(c, cmd, conn->outgoing);
+  response_end(conn->outgoing, header_pos);
+  conn->proto = g_data.proto; // After HELLO
 
+  // Done with the arguments, remove the request message
+  buf_consume(conn->incoming, len);
   return true; // Success
 }
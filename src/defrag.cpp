@@ -0,0 +1,154 @@
+#include "defrag.h"
+#include "config.h"
+#include "global_state.h"
+#include "shared.h"
+#include "slab.h"
+#include "storage.h"
+#include "timer.h"
+#include <atomic>
+#include <string>
+#include <vector>
+
+const uint64_t k_defrag_check_ms = 100;  // between fragmentation checks
+const uint64_t k_defrag_step_ms = 10;    // between the steps of a pass
+const uint64_t k_defrag_idle_ms = 10000; // after a pass that moved nothing
+// Free bytes in the pages of a shard that start a pass: both this much and
+// this percentage of the pages. Each size class keeps a page.
+const int64_t k_defrag_min_bytes = 4 << 20;
+const int64_t k_defrag_min_pct = 10;
+// Members of a sorted set moved with its key, a larger one is moved over
+// several steps
+const size_t k_defrag_zset_inline = 64;
+
+// Per event loop defragmentation state
+struct DefragState {
+  bool running = false; // a pass is in progress
+  uint64_t next_ms = 0; // of the next step or check
+  uint64_t cursor = 0;  // keyspace hm_scan() cursor
+  bool scanned = false; // the cursor went through the keyspace
+  uint64_t moved = 0;   // by this pass
+  // Large sorted sets found by the scan, by key as they may be deleted in
+  // between. The last one is being scanned with `zcursor`.
+  std::vector<std::string> zsets;
+  uint64_t zcursor = 0;
+  // nodes of a scan position
+  std::vector<HNode *> entries;
+  std::vector<HNode *> members;
+};
+
+static thread_local DefragState g_defrag;
+static std::atomic<uint64_t> g_moved{0};
+
+uint64_t defrag_moved() { return g_moved.load(std::memory_order_relaxed); }
+
+uint64_t defrag_next_ms() {
+  return g_config.defrag_us ? g_defrag.next_ms : (uint64_t)-1;
+}
+
+static void collect(HNode *node, void *arg) {
+  ((std::vector<HNode *> *)arg)->push_back(node);
+}
+
+// move the members of a scan position, returns the next cursor
+static uint64_t defrag_zset(ZSet *zset, uint64_t cursor) {
+  DefragState &st = g_defrag;
+  st.members.clear();
+  cursor = hm_scan(&zset->hmap, cursor, &collect, &st.members);
+  for (HNode *node : st.members) {
+    ZNode *znode = container_of(node, ZNode, hmap);
+    st.moved += znode_defrag(zset, znode) != znode;
+  }
+  return cursor;
+}
+
+static void defrag_entry(Entry *ent) {
+  DefragState &st = g_defrag;
+  Entry *copy = entry_defrag(ent);
+  st.moved += copy != ent;
+  if (copy->type != T_ZSET) {
+    return;
+  }
+  if (copy->zset->enc == ZSET_LISTPACK) {
+    st.moved += zset_defrag_listpack(copy->zset);
+    return;
+  }
+  if (zset_size(copy->zset) > k_defrag_zset_inline) {
+    st.zsets.push_back(std::string(entry_key(copy)));
+    return;
+  }
+  uint64_t cursor = 0;
+  do {
+    cursor = defrag_zset(copy->zset, cursor);
+  } while (cursor);
+}
+
+static ZSet *lookup_zset(const std::string &name) {
+  LookupKey key;
+  key.key = name;
+  key.node.hcode = str_hash((uint8_t *)name.data(), name.size());
+  HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+  Entry *ent = node ? container_of(node, Entry, node) : NULL;
+  bool tree = ent && ent->type == T_ZSET && ent->zset->enc == ZSET_TREE;
+  return tree ? ent->zset : NULL;
+}
+
+// Scan until the deadline, returns false once the pass is done
+static bool defrag_step(uint64_t deadline_us) {
+  DefragState &st = g_defrag;
+  for (uint32_t n = 1;; n++) {
+    if (n % 16 == 0 && get_monotonic_usec() > deadline_us) {
+      return true;
+    }
+    if (st.zsets.empty() && st.scanned) {
+      return false;
+    }
+    if (!st.zsets.empty()) {
+      ZSet *zset = lookup_zset(st.zsets.back());
+      st.zcursor = zset ? defrag_zset(zset, st.zcursor) : 0;
+      if (!st.zcursor) {
+        st.zsets.pop_back();
+      }
+      continue;
+    }
+    // the nodes are collected first, hm_scan() callbacks can't modify
+    st.entries.clear();
+    st.cursor = hm_scan(&g_data.db, st.cursor, &collect, &st.entries);
+    for (HNode *node : st.entries) {
+      defrag_entry(container_of(node, Entry, node));
+    }
+    st.scanned = st.cursor == 0;
+  }
+}
+
+static bool fragmented() {
+  SlabStats stats = slab_thread_stats();
+  int64_t free = stats.pages - stats.used;
+  return free >= k_defrag_min_bytes &&
+         free * 100 >= stats.pages * k_defrag_min_pct;
+}
+
+void defrag_cron(uint64_t now_ms) {
+  DefragState &st = g_defrag;
+  if (!g_config.defrag_us || now_ms < st.next_ms) {
+    return;
+  }
+  if (!st.running) {
+    if (!fragmented()) {
+      st.next_ms = now_ms + k_defrag_check_ms;
+      return;
+    }
+    st.running = true;
+    st.cursor = 0;
+    st.scanned = false;
+    st.moved = 0;
+  }
+  uint64_t moved = st.moved;
+  bool more = defrag_step(get_monotonic_usec() + g_config.defrag_us);
+  g_moved.fetch_add(st.moved - moved, std::memory_order_relaxed);
+  if (more) {
+    st.next_ms = now_ms + k_defrag_step_ms;
+    return;
+  }
+  st.running = false;
+  st.next_ms = now_ms + (st.moved ? k_defrag_check_ms : k_defrag_idle_ms);
+}
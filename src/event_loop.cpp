@@ -0,0 +1,140 @@
+#include "event_loop.h"
+#include "shared.h"
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+
+// max number of events drained by a single epoll_wait()
+const size_t k_max_events = 1024;
+
+bool ev_init(EventLoop *loop, int backend) {
+  loop->backend = backend;
+  if (backend == EV_BACKEND_EPOLL) {
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd < 0) {
+      msg_errno("epoll_create1()");
+      return false;
+    }
+    loop->ready.resize(k_max_events);
+  }
+  return true;
+}
+
+static uint32_t to_epoll(uint32_t flags) {
+  uint32_t events = 0;
+  if (flags & EV_READ) {
+    events |= EPOLLIN;
+  }
+  if (flags & EV_WRITE) {
+    events |= EPOLLOUT;
+  }
+  return events;
+}
+
+static void epoll_ctl_fd(EventLoop *loop, int op, int fd, uint32_t flags) {
+  struct epoll_event ev = {};
+  ev.events = to_epoll(flags);
+  ev.data.fd = fd;
+  if (epoll_ctl(loop->epfd, op, fd, &ev) < 0) {
+    die("epoll_ctl()");
+  }
+}
+
+void ev_add(EventLoop *loop, int fd, uint32_t flags) {
+  if (loop->backend == EV_BACKEND_EPOLL) {
+    return epoll_ctl_fd(loop, EPOLL_CTL_ADD, fd, flags);
+  }
+  if (loop->interest.size() <= (size_t)fd) {
+    loop->interest.resize(fd + 1);
+  }
+  loop->interest[fd] = flags | EV_ERR; // non-zero marks a registered fd
+}
+
+void ev_mod(EventLoop *loop, int fd, uint32_t flags) {
+  if (loop->backend == EV_BACKEND_EPOLL) {
+    return epoll_ctl_fd(loop, EPOLL_CTL_MOD, fd, flags);
+  }
+  assert(loop->interest[fd]);
+  loop->interest[fd] = flags | EV_ERR;
+}
+
+void ev_del(EventLoop *loop, int fd) {
+  if (loop->backend == EV_BACKEND_EPOLL) {
+    (void)epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+    return;
+  }
+  loop->interest[fd] = 0;
+}
+
+static int poll_wait(EventLoop *loop, std::vector<Event> &out,
+                     int timeout_ms) {
+  // prepare the arguments of the poll()
+  loop->poll_args.clear();
+  for (size_t fd = 0; fd < loop->interest.size(); fd++) {
+    uint32_t flags = loop->interest[fd];
+    if (!flags) {
+      continue;
+    }
+    // always poll() for error
+    struct pollfd pfd = {(int)fd, POLLERR, 0};
+    if (flags & EV_READ) {
+      pfd.events |= POLLIN;
+    }
+    if (flags & EV_WRITE) {
+      pfd.events |= POLLOUT;
+    }
+    loop->poll_args.push_back(pfd);
+  }
+
+  int rv = poll(loop->poll_args.data(), (nfds_t)loop->poll_args.size(),
+                timeout_ms);
+  if (rv <= 0) {
+    return rv;
+  }
+  for (const struct pollfd &pfd : loop->poll_args) {
+    if (!pfd.revents) {
+      continue;
+    }
+    Event ev = {pfd.fd, 0};
+    if (pfd.revents & POLLIN) {
+      ev.flags |= EV_READ;
+    }
+    if (pfd.revents & POLLOUT) {
+      ev.flags |= EV_WRITE;
+    }
+    if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+      ev.flags |= EV_ERR;
+    }
+    out.push_back(ev);
+  }
+  return (int)out.size();
+}
+
+static int epoll_wait_batch(EventLoop *loop, std::vector<Event> &out,
+                            int timeout_ms) {
+  int rv = epoll_wait(loop->epfd, loop->ready.data(), (int)loop->ready.size(),
+                      timeout_ms);
+  for (int i = 0; i < rv; i++) {
+    const struct epoll_event &e = loop->ready[i];
+    Event ev = {e.data.fd, 0};
+    if (e.events & EPOLLIN) {
+      ev.flags |= EV_READ;
+    }
+    if (e.events & EPOLLOUT) {
+      ev.flags |= EV_WRITE;
+    }
+    if (e.events & (EPOLLERR | EPOLLHUP)) {
+      ev.flags |= EV_ERR;
+    }
+    out.push_back(ev);
+  }
+  return rv;
+}
+
+int ev_wait(EventLoop *loop, std::vector<Event> &out, int timeout_ms) {
+  out.clear();
+  if (loop->backend == EV_BACKEND_EPOLL) {
+    return epoll_wait_batch(loop, out, timeout_ms);
+  }
+  return poll_wait(loop, out, timeout_ms);
+}
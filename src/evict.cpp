@@ -0,0 +1,257 @@
+#include "evict.h"
+#include "config.h"
+#include "global_state.h"
+#include "mem_stats.h"
+#include "shared.h"
+#include "storage.h"
+#include "timer.h"
+#include <algorithm>
+#include <assert.h>
+#include <atomic>
+#include <string>
+
+// Entry::access holds, depending on the policy:
+// - LRU: the time of the last access in ms, an idle time of more than 49
+//   days wraps around
+// - LFU: the time of the last access in minutes (24 bits), and a counter
+//   (8 bits) that grows logarithmically with the accesses, like a Morris
+//   counter, and decays by 1 per minute without one
+const uint32_t k_lfu_init = 5;          // so a new key isn't the first to go
+const uint32_t k_lfu_log_factor = 10;   // 255 after about 1M accesses
+const size_t k_evict_pool = 16;         // candidates kept between samples
+const size_t k_max_samples = 64;        // --maxmemory-samples limit
+const uint64_t k_evict_budget_us = 500; // eviction work per command
+const uint32_t k_used_refresh = 64;     // writes between reads of mem_used()
+
+static const char *const k_policy_names[] = {
+    "noeviction",
+    "allkeys-lru",
+    "allkeys-lfu",
+    "volatile-ttl",
+};
+
+// a key sampled for eviction, looked up again when its turn comes
+struct EvictCandidate {
+  uint64_t idle = 0; // the higher, the sooner it's evicted
+  uint64_t hcode = 0;
+  std::string key;
+};
+
+// Per event loop eviction state
+struct EvictState {
+  // By increasing idle score. No global LRU list is kept, the pool holds
+  // the best candidates of the samples taken so far.
+  EvictCandidate pool[k_evict_pool];
+  size_t pool_len = 0;
+  uint64_t rng = 0;    // wyrand state
+  uint64_t now_ms = 0; // evict_clock_update()
+  int64_t used = 0;    // mem_used() when last read
+  int64_t own = 0;     // own_memory() at the same time
+  uint32_t writes = 0; // since then
+};
+
+static thread_local EvictState g_evict;
+static std::atomic<uint64_t> g_evicted{0};
+
+int evict_policy(const char *name) {
+  for (uint32_t i = 0; i <= EVICT_VOLATILE_TTL; i++) {
+    if (strcmp(name, k_policy_names[i]) == 0) {
+      return (int)i;
+    }
+  }
+  return -1;
+}
+
+const char *evict_policy_name(uint32_t policy) {
+  return k_policy_names[policy];
+}
+
+uint64_t evict_count() { return g_evicted.load(std::memory_order_relaxed); }
+
+static uint64_t rng_next() {
+  uint64_t &s = g_evict.rng;
+  s += 0xa0761d6478bd642full;
+  return hash_mix(s, s ^ 0xe7037ed1a0b428dbull);
+}
+
+void evict_clock_update() {
+  uint32_t policy = g_config.maxmemory_policy;
+  if (policy == EVICT_ALLKEYS_LRU || policy == EVICT_ALLKEYS_LFU) {
+    g_evict.now_ms = get_monotonic_msec();
+  }
+}
+
+static uint32_t lru_clock() { return (uint32_t)g_evict.now_ms; }
+
+static uint32_t lfu_minutes() {
+  return (uint32_t)(g_evict.now_ms / 60000) & 0xFFFFFF;
+}
+
+// the counter of an LFU clock, less the minutes since the last access
+static uint32_t lfu_decayed(uint32_t access) {
+  uint32_t idle = (lfu_minutes() - (access >> 8)) & 0xFFFFFF;
+  uint32_t counter = access & 0xFF;
+  return idle < counter ? counter - idle : 0;
+}
+
+uint32_t evict_access_new() {
+  switch (g_config.maxmemory_policy) {
+  case EVICT_ALLKEYS_LRU:
+    return lru_clock();
+  case EVICT_ALLKEYS_LFU:
+    return lfu_minutes() << 8 | k_lfu_init;
+  default:
+    return 0;
+  }
+}
+
+void evict_touch(Entry *ent) {
+  if (g_config.maxmemory_policy == EVICT_ALLKEYS_LRU) {
+    ent->access = lru_clock();
+  } else if (g_config.maxmemory_policy == EVICT_ALLKEYS_LFU) {
+    uint32_t counter = lfu_decayed(ent->access);
+    // incremented with a probability of 1 / (base * factor + 1)
+    uint32_t base = counter > k_lfu_init ? counter - k_lfu_init : 0;
+    if (counter < 255 && rng_next() % (base * k_lfu_log_factor + 1) == 0) {
+      counter++;
+    }
+    ent->access = lfu_minutes() << 8 | counter;
+  }
+}
+
+static uint64_t idle_score(const Entry *ent) {
+  if (g_config.maxmemory_policy == EVICT_ALLKEYS_LFU) {
+    return 255 - lfu_decayed(ent->access);
+  }
+  return (uint32_t)(lru_clock() - ent->access);
+}
+
+// keep a sampled entry if it's a better candidate than the worst one
+static void pool_insert(const Entry *ent) {
+  EvictState &st = g_evict;
+  std::string_view key = entry_key(ent);
+  for (size_t i = 0; i < st.pool_len; i++) {
+    if (st.pool[i].hcode == ent->node.hcode && st.pool[i].key == key) {
+      return; // sampled already
+    }
+  }
+  uint64_t idle = idle_score(ent);
+  size_t i = 0;
+  while (i < st.pool_len && st.pool[i].idle < idle) {
+    i++;
+  }
+  if (st.pool_len < k_evict_pool) {
+    // make room at `i`, the strings are moved with their buffers
+    std::rotate(st.pool + i, st.pool + st.pool_len, st.pool + st.pool_len + 1);
+    st.pool_len++;
+  } else if (i == 0) {
+    return; // worse than all of them
+  } else {
+    // drop the first one
+    std::rotate(st.pool, st.pool + 1, st.pool + i);
+    i--;
+  }
+  st.pool[i].idle = idle;
+  st.pool[i].hcode = ent->node.hcode;
+  st.pool[i].key.assign(key.data(), key.size());
+}
+
+// the best candidate that still exists, NULL if the pool runs out
+static Entry *pool_pop() {
+  EvictState &st = g_evict;
+  while (st.pool_len > 0) {
+    EvictCandidate &c = st.pool[--st.pool_len];
+    LookupKey key;
+    key.key = c.key;
+    key.node.hcode = c.hcode;
+    if (HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq)) {
+      return container_of(node, Entry, node);
+    }
+  }
+  return NULL;
+}
+
+// LRU and LFU: add random keys to the pool, then take the best one
+static Entry *sampled_candidate() {
+  HNode *nodes[k_max_samples];
+  size_t samples = std::min((size_t)g_config.maxmemory_samples, k_max_samples);
+  // a sample can miss in a sparse part of the table
+  for (uint32_t tries = 0; tries < 16 && hm_size(&g_data.db); tries++) {
+    size_t n = hm_sample(&g_data.db, rng_next(), nodes, samples);
+    for (size_t i = 0; i < n; i++) {
+      pool_insert(container_of(nodes[i], Entry, node));
+    }
+    if (Entry *ent = pool_pop()) {
+      return ent;
+    }
+  }
+  return NULL;
+}
+
+// volatile-ttl: the keys with a TTL are in the timing wheel, which has the
+// ones expiring first at hand, no sampling is needed
+static Entry *ttl_candidate() {
+  TimerNode *timer = tw_peek(&g_data.timers);
+  return timer ? container_of(timer, Entry, ttl) : NULL;
+}
+
+static bool hnode_same(HNode *node, HNode *key) { return node == key; }
+
+// The keyspace memory counted by this thread. Not the buffers: the reply
+// to a forwarded request is allocated by the shard owning the key and
+// freed by the one owning the connection.
+static int64_t own_memory() {
+  int64_t sum = 0;
+  for (uint32_t i = MEM_ENTRIES; i <= MEM_HASHTABLES; i++) {
+    sum += g_mem.bytes[i].load(std::memory_order_relaxed);
+  }
+  return sum;
+}
+
+// The memory use, from mem_used() which sums the counters of all the
+// threads under a lock. In between, the changes made by this thread to its
+// keyspace are added to the last sum, the rest is seen at the next read.
+static int64_t used_memory() {
+  EvictState &st = g_evict;
+  int64_t own = own_memory();
+  if (st.writes++ % k_used_refresh == 0) {
+    st.used = mem_used();
+    st.own = own;
+  }
+  return st.used + own - st.own;
+}
+
+bool evict_for_write() {
+  if (!g_config.maxmemory) {
+    return true;
+  }
+  int64_t over = used_memory() - (int64_t)g_config.maxmemory;
+  if (over <= 0) {
+    return true;
+  }
+  uint32_t policy = g_config.maxmemory_policy;
+  if (policy == EVICT_NONE) {
+    return false;
+  }
+  // Bounded per command, a large value evicting many small keys leaves the
+  // rest to the next writes. The memory of a large zset is released later,
+  // by the thread pool.
+  uint64_t deadline = get_monotonic_usec() + k_evict_budget_us;
+  int64_t freed = 0;
+  for (uint32_t n = 1; freed < over; n++) {
+    Entry *ent = policy == EVICT_VOLATILE_TTL ? ttl_candidate()
+                                              : sampled_candidate();
+    if (!ent) {
+      return false;
+    }
+    freed += (int64_t)entry_mem(ent);
+    HNode *node = hm_delete(&g_data.db, &ent->node, &hnode_same);
+    assert(node == &ent->node);
+    entry_del(ent);
+    g_evicted.fetch_add(1, std::memory_order_relaxed);
+    if (n % 16 == 0 && get_monotonic_usec() > deadline) {
+      break;
+    }
+  }
+  return true;
+}
@@ -1,6 +1,16 @@
 #include "hashtable.h"
+#include "mem_stats.h"
+
+#ifndef HMAP_SWISS // the chaining engine
+
 #include <assert.h>
 #include <stdlib.h>
+#include <utility>
+
+// bytes allocated for the slots
+static size_t h_mem(const HTab *htab) {
+  return htab->tab ? (htab->mask + 1) * sizeof(HNode *) : 0;
+}
 
 // n must be a power of 2
 static void h_init(HTab *htab, size_t n) {
@@ -10,6 +20,13 @@ static void h_init(HTab *htab, size_t n) {
   htab->tab = (HNode **)calloc(n, sizeof(HNode *));
   htab->mask = n - 1;
   htab->size = 0;
+  mem_add(MEM_HASHTABLES, (int64_t)h_mem(htab));
+}
+
+static void h_free(HTab *htab) {
+  mem_add(MEM_HASHTABLES, -(int64_t)h_mem(htab));
+  free(htab->tab);
+  *htab = HTab{};
 }
 
 // hashtable insertion
@@ -61,11 +78,15 @@ const size_t k_rehashing_work = 128; // constant work
 
 static void hm_help_rehashing(HMap *hmap) {
   size_t nwork = 0;
-  while (nwork < k_rehashing_work && hmap->older.size > 0) {
+  // empty slots are bounded too, a table being shrunk is mostly empty
+  size_t nscan = 0;
+  while (nwork < k_rehashing_work && nscan < k_rehashing_work * 16 &&
+         hmap->older.size > 0) {
     // find a non-empty slot
     HNode **from = &hmap->older.tab[hmap->migrate_pos];
     if (!*from) {
       hmap->migrate_pos++;
+      nscan++;
       continue; // empty slot
     }
     // move the first list item to the newer table
@@ -74,17 +95,17 @@ static void hm_help_rehashing(HMap *hmap) {
   }
   // discard the old table if done
   if (hmap->older.size == 0 && hmap->older.tab) {
-    free(hmap->older.tab);
-    hmap->older = HTab{};
+    h_free(&hmap->older);
   }
 }
 
-static void hm_trigger_rehashing(HMap *hmap) {
+// start moving the keys to a new table of `n` slots
+static void hm_trigger_rehashing(HMap *hmap, size_t n) {
   assert(hmap->older.tab == NULL);
   // move the newer table to the older table
   // and create a new table for the newer table
   hmap->older = hmap->newer;
-  h_init(&hmap->newer, (hmap->newer.mask + 1) * 2);
+  h_init(&hmap->newer, n);
   hmap->migrate_pos = 0;
 }
 
@@ -97,41 +118,174 @@ HNode *hm_lookup(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *)) {
   return from ? *from : NULL;
 }
 
+static void h_prefetch_slot(HTab *htab, HNode *key) {
+  if (htab->tab) {
+    __builtin_prefetch(&htab->tab[key->hcode & htab->mask]);
+  }
+}
+
+static void h_prefetch_head(HTab *htab, HNode *key) {
+  if (htab->tab) {
+    if (HNode *head = htab->tab[key->hcode & htab->mask]) {
+      __builtin_prefetch(head);
+    }
+  }
+}
+
+// Two passes: the slots of all the keys are requested at once, then by the
+// time the second pass reads them they have arrived and the chain heads can
+// be requested. Each pass has n misses in flight instead of one.
+void hm_prefetch(HMap *hmap, HNode **keys, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    h_prefetch_slot(&hmap->newer, keys[i]);
+    h_prefetch_slot(&hmap->older, keys[i]);
+  }
+  for (size_t i = 0; i < n; i++) {
+    h_prefetch_head(&hmap->newer, keys[i]);
+    h_prefetch_head(&hmap->older, keys[i]);
+  }
+}
+
+// a lookup in progress: the chain node to compare next
+struct HProbe {
+  HNode *cur = NULL;
+  bool older = false; // walking the chain of the older table
+  bool done = false;
+};
+
+static HNode *h_slot(HTab *htab, HNode *key) {
+  return htab->tab ? htab->tab[key->hcode & htab->mask] : NULL;
+}
+
+// The chains of a group of keys are walked in lockstep, one node per key
+// per round, and each round prefetches the nodes of the next one. A chain
+// of k nodes costs about k memory latencies for the whole group instead of
+// k for every key.
+void hm_lookup_many(HMap *hmap, HNode **keys, size_t n,
+                    bool (*eq)(HNode *, HNode *), HNode **out) {
+  HProbe probes[k_prefetch_group];
+  for (size_t base = 0; base < n; base += k_prefetch_group) {
+    size_t m = base + k_prefetch_group < n ? k_prefetch_group : n - base;
+    hm_help_rehashing(hmap);
+    hm_prefetch(hmap, &keys[base], m);
+    for (size_t i = 0; i < m; i++) {
+      probes[i] = HProbe{};
+      probes[i].cur = h_slot(&hmap->newer, keys[base + i]);
+    }
+
+    size_t active = m;
+    while (active > 0) {
+      for (size_t i = 0; i < m; i++) {
+        HProbe &p = probes[i];
+        HNode *key = keys[base + i];
+        if (p.done) {
+          continue;
+        }
+        if (!p.cur) { // end of a chain
+          if (!p.older && hmap->older.tab) {
+            p.older = true;
+            p.cur = h_slot(&hmap->older, key);
+            if (p.cur) {
+              __builtin_prefetch(p.cur);
+              continue;
+            }
+          }
+          out[base + i] = NULL;
+          p.done = true;
+          active--;
+        } else if (p.cur->hcode == key->hcode && eq(p.cur, key)) {
+          out[base + i] = p.cur;
+          p.done = true;
+          active--;
+        } else {
+          p.cur = p.cur->next;
+          if (p.cur) {
+            __builtin_prefetch(p.cur);
+          }
+        }
+      }
+    }
+  }
+}
+
 // load factor = keys / slots
 const size_t k_max_load_factor = 8;
+// Shrink once there are 2 slots per key, to a table with a load factor of
+// 2 to 4. That's far from both limits, so a few inserts or deletes after a
+// resize don't trigger the opposite one.
+const size_t k_min_slots = 4;
 
 void hm_insert(HMap *hmap, HNode *node) {
   if (!hmap->newer.tab) {
-    h_init(&hmap->newer, 4); // initialize it if empty
+    h_init(&hmap->newer, k_min_slots); // initialize it if empty
   }
   h_insert(&hmap->newer, node); // always insert to the newer table
 
   if (!hmap->older.tab) { // check whether we need to rehash
     size_t shreshold = (hmap->newer.mask + 1) * k_max_load_factor;
     if (hmap->newer.size >= shreshold) {
-      hm_trigger_rehashing(hmap);
+      hm_trigger_rehashing(hmap, (hmap->newer.mask + 1) * 2);
     }
   }
   hm_help_rehashing(hmap); // migrate some keys
 }
 
+// after mass deletions, e.g. expirations
+static void hm_maybe_shrink(HMap *hmap) {
+  size_t slots = hmap->newer.mask + 1;
+  if (hmap->older.tab || slots <= k_min_slots ||
+      hmap->newer.size * 2 >= slots) {
+    return;
+  }
+  size_t n = k_min_slots;
+  while (n * 4 < hmap->newer.size) {
+    n *= 2;
+  }
+  hm_trigger_rehashing(hmap, n);
+}
+
 HNode *hm_delete(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *)) {
   hm_help_rehashing(hmap);
+  HNode *node = NULL;
   if (HNode **from = h_lookup(&hmap->newer, key, eq)) {
-    return h_detach(&hmap->newer, from);
+    node = h_detach(&hmap->newer, from);
+  } else if (HNode **from = h_lookup(&hmap->older, key, eq)) {
+    node = h_detach(&hmap->older, from);
   }
-  if (HNode **from = h_lookup(&hmap->older, key, eq)) {
-    return h_detach(&hmap->older, from);
+  if (node) {
+    hm_maybe_shrink(hmap);
   }
-  return NULL;
+  return node;
+}
+
+static bool h_same(HNode *node, HNode *key) { return node == key; }
+
+void hm_replace(HMap *hmap, HNode *old, HNode *node) {
+  HNode **from = h_lookup(&hmap->newer, old, &h_same);
+  if (!from) {
+    from = h_lookup(&hmap->older, old, &h_same);
+  }
+  assert(from);
+  *from = node; // the rest of the chain is linked from the copy
+}
+
+bool hm_rehashing(HMap *hmap) { return hmap->older.tab != NULL; }
+
+bool hm_rehash(HMap *hmap) {
+  hm_help_rehashing(hmap);
+  return hm_rehashing(hmap);
 }
 
 void hm_clear(HMap *hmap) {
-  free(hmap->newer.tab);
-  free(hmap->older.tab);
+  h_free(&hmap->newer);
+  h_free(&hmap->older);
   *hmap = HMap{};
 }
 
+size_t hm_mem(const HMap *hmap) {
+  return h_mem(&hmap->newer) + h_mem(&hmap->older);
+}
+
 size_t hm_size(HMap *hmap) { return hmap->newer.size + hmap->older.size; }
 
 static bool h_foreach(HTab *htab, bool (*f)(HNode *, void *), void *arg) {
@@ -148,3 +302,75 @@ static bool h_foreach(HTab *htab, bool (*f)(HNode *, void *), void *arg) {
 void hm_foreach(HMap *hmap, bool (*f)(HNode *, void *), void *arg) {
   h_foreach(&hmap->newer, f, arg) && h_foreach(&hmap->older, f, arg);
 }
+
+size_t hm_sample(HMap *hmap, uint64_t pos, HNode **out, size_t n) {
+  HTab *tabs[2] = {&hmap->newer, &hmap->older};
+  size_t found = 0;
+  for (size_t step = 0; found < n && step < n * 10; step++, pos++) {
+    for (HTab *htab : tabs) {
+      if (!htab->size) {
+        continue;
+      }
+      HNode *node = htab->tab[pos & htab->mask];
+      for (; node && found < n; node = node->next) {
+        out[found++] = node;
+      }
+    }
+  }
+  return found;
+}
+
+// the cursor is a slot index
+static uint64_t h_scan_mask(HTab *htab) { return htab->mask; }
+
+static void h_scan(HTab *htab, size_t pos, void (*f)(HNode *, void *),
+                   void *arg) {
+  for (HNode *node = htab->tab[pos]; node; node = node->next) {
+    f(node, arg);
+  }
+}
+
+static uint64_t rev_bits(uint64_t v) {
+  v = ((v >> 1) & 0x5555555555555555ull) | ((v & 0x5555555555555555ull) << 1);
+  v = ((v >> 2) & 0x3333333333333333ull) | ((v & 0x3333333333333333ull) << 2);
+  v = ((v >> 4) & 0x0F0F0F0F0F0F0F0Full) | ((v & 0x0F0F0F0F0F0F0F0Full) << 4);
+  return __builtin_bswap64(v);
+}
+
+// increment the bits of `mask`, starting from the high one
+static uint64_t rev_next(uint64_t cursor, uint64_t mask) {
+  cursor |= ~mask;
+  return rev_bits(rev_bits(cursor) + 1);
+}
+
+// With both tables, the position in the smaller one and all the positions
+// it splits into in the larger one are visited together.
+uint64_t hm_scan(HMap *hmap, uint64_t cursor, void (*f)(HNode *, void *),
+                 void *arg) {
+  HTab *small = &hmap->newer;
+  HTab *large = &hmap->older;
+  if (large->size == 0) {
+    if (small->size == 0) {
+      return 0; // empty
+    }
+    h_scan(small, cursor & h_scan_mask(small), f, arg);
+    return rev_next(cursor, h_scan_mask(small));
+  }
+  if (h_scan_mask(small) > h_scan_mask(large)) {
+    std::swap(small, large);
+  }
+  uint64_t m0 = h_scan_mask(small);
+  uint64_t m1 = h_scan_mask(large);
+  // all of them: after a shrink, the high bits of a cursor from the larger
+  // table alone are part way through the reversed order
+  cursor &= m0;
+  h_scan(small, cursor, f, arg);
+  do {
+    h_scan(large, cursor & m1, f, arg);
+    // the bits of the larger mask only
+    cursor = (((cursor | m0) + 1) & ~m0) | (cursor & m0);
+  } while (cursor & (m0 ^ m1));
+  return rev_next(cursor, m0);
+}
+
+#endif // HMAP_SWISS
@@ -0,0 +1,447 @@
+#include "hashtable.h"
+#include "mem_stats.h"
+
+#ifdef HMAP_SWISS // the open addressing engine, see HTab
+
+#include <assert.h>
+#include <stdlib.h>
+#include <utility>
+#include <sys/types.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+const size_t k_group = 16;       // slots compared at once
+const uint8_t k_ctrl_empty = 0;  // never used, ends a probe sequence
+const uint8_t k_ctrl_deleted = 1; // was used, probing goes on
+
+// the control byte of a used slot: 7 bits of the hash that the slot index
+// doesn't already depend on
+static uint8_t h_tag(uint64_t hcode) { return 0x80 | (uint8_t)(hcode & 0x7F); }
+
+// bit i is set if ctrl[i] == byte
+static uint32_t group_match(const uint8_t *ctrl, uint8_t byte) {
+#ifdef __SSE2__
+  __m128i group = _mm_load_si128((const __m128i *)ctrl);
+  __m128i match = _mm_cmpeq_epi8(group, _mm_set1_epi8((char)byte));
+  return (uint32_t)_mm_movemask_epi8(match);
+#else
+  uint32_t mask = 0;
+  for (size_t i = 0; i < k_group; i++) {
+    mask |= (uint32_t)(ctrl[i] == byte) << i;
+  }
+  return mask;
+#endif
+}
+
+// bit i is set if slot i is empty or deleted
+static uint32_t group_free(const uint8_t *ctrl) {
+#ifdef __SSE2__
+  __m128i group = _mm_load_si128((const __m128i *)ctrl);
+  return ~(uint32_t)_mm_movemask_epi8(group) & 0xFFFF;
+#else
+  uint32_t mask = 0;
+  for (size_t i = 0; i < k_group; i++) {
+    mask |= (uint32_t)(ctrl[i] < 0x80) << i;
+  }
+  return mask;
+#endif
+}
+
+// Probe sequence over the groups: starts at the group picked by the hash
+// bits above the tag, then steps by 1, 2, 3... groups, which visits every
+// group of a power of 2 table.
+struct HProbeSeq {
+  size_t group;
+  size_t gmask;
+  size_t step = 0;
+  HProbeSeq(const HTab *htab, uint64_t hcode)
+      : group((size_t)(hcode >> 7) & (htab->mask / k_group)),
+        gmask(htab->mask / k_group) {}
+  size_t offset() const { return group * k_group; }
+  void next() { group = (group + ++step) & gmask; }
+};
+
+// bytes allocated for the control bytes and slots
+static size_t h_mem(const HTab *htab) {
+  return htab->ctrl ? (htab->mask + 1) * (1 + sizeof(HNode *)) : 0;
+}
+
+// n must be a power of 2
+static void h_init(HTab *htab, size_t n) {
+  assert(n >= k_group && ((n - 1) & n) == 0);
+  // calloc for fast zero initialization instead of O(n), empty is 0.
+  // malloc alignment is 16 bytes, enough for the aligned group loads.
+  htab->ctrl = (uint8_t *)calloc(n, 1);
+  assert(((uintptr_t)htab->ctrl & (k_group - 1)) == 0);
+  htab->slots = (HNode **)calloc(n, sizeof(HNode *));
+  htab->mask = n - 1;
+  htab->size = 0;
+  htab->used = 0;
+  mem_add(MEM_HASHTABLES, (int64_t)h_mem(htab));
+}
+
+static void h_free(HTab *htab) {
+  mem_add(MEM_HASHTABLES, -(int64_t)h_mem(htab));
+  free(htab->ctrl);
+  free(htab->slots);
+  *htab = HTab{};
+}
+
+// keys + deleted slots allowed before the table is replaced: 7/8
+static size_t h_max_used(const HTab *htab) {
+  return (htab->mask + 1) - (htab->mask + 1) / 8;
+}
+
+// hashtable insertion, into the first free slot of the probe sequence
+static void h_insert(HTab *htab, HNode *node) {
+  for (HProbeSeq seq(htab, node->hcode);; seq.next()) {
+    uint8_t *ctrl = &htab->ctrl[seq.offset()];
+    uint32_t free_mask = group_free(ctrl);
+    if (free_mask) {
+      size_t i = (size_t)__builtin_ctz(free_mask);
+      htab->used += ctrl[i] == k_ctrl_empty;
+      ctrl[i] = h_tag(node->hcode);
+      htab->slots[seq.offset() + i] = node;
+      htab->size++;
+      return;
+    }
+  }
+}
+
+// hashtable look up subroutine.
+// returns the index of the slot holding the target node, or -1.
+static ssize_t h_lookup(HTab *htab, HNode *key, bool (*eq)(HNode *, HNode *)) {
+  if (!htab->ctrl) {
+    return -1;
+  }
+  uint8_t tag = h_tag(key->hcode);
+  HProbeSeq seq(htab, key->hcode);
+  for (size_t n = 0; n <= seq.gmask; n++, seq.next()) {
+    const uint8_t *ctrl = &htab->ctrl[seq.offset()];
+    for (uint32_t m = group_match(ctrl, tag); m; m &= m - 1) {
+      size_t pos = seq.offset() + (size_t)__builtin_ctz(m);
+      HNode *cur = htab->slots[pos];
+      if (cur->hcode == key->hcode && eq(cur, key)) {
+        return (ssize_t)pos;
+      }
+    }
+    if (group_match(ctrl, k_ctrl_empty)) {
+      return -1; // the key would have been put here
+    }
+  }
+  return -1;
+}
+
+// empty the slot
+static HNode *h_detach(HTab *htab, size_t pos) {
+  HNode *node = htab->slots[pos];
+  uint8_t *group = &htab->ctrl[pos & ~(k_group - 1)];
+  // A group that still has an empty slot has never been full, so no probe
+  // sequence goes past it and the slot can be empty again. Otherwise it's
+  // marked deleted to keep the sequences going through it intact.
+  if (group_match(group, k_ctrl_empty)) {
+    htab->ctrl[pos] = k_ctrl_empty;
+    htab->used--;
+  } else {
+    htab->ctrl[pos] = k_ctrl_deleted;
+  }
+  htab->slots[pos] = NULL;
+  htab->size--;
+  return node;
+}
+
+const size_t k_rehashing_work = 128; // constant work
+
+static void hm_help_rehashing(HMap *hmap) {
+  size_t nwork = 0;
+  // empty slots are bounded too, the older table can be sparse
+  size_t nscan = 0;
+  while (nwork < k_rehashing_work && nscan < k_rehashing_work * k_group &&
+         hmap->older.size > 0) {
+    size_t pos = hmap->migrate_pos;
+    assert(pos <= hmap->older.mask);
+    if (hmap->older.ctrl[pos] < 0x80) {
+      hmap->migrate_pos++;
+      nscan++;
+      continue; // free slot
+    }
+    // move the node to the newer table
+    h_insert(&hmap->newer, h_detach(&hmap->older, pos));
+    hmap->migrate_pos++;
+    nwork++;
+  }
+  // discard the old table if done
+  if (hmap->older.size == 0 && hmap->older.ctrl) {
+    h_free(&hmap->older);
+  }
+}
+
+// start moving the keys to a new table of `n` slots
+static void hm_trigger_rehashing(HMap *hmap, size_t n) {
+  assert(hmap->older.ctrl == NULL);
+  hmap->older = hmap->newer;
+  h_init(&hmap->newer, n);
+  hmap->migrate_pos = 0;
+}
+
+// The newer table is out of free slots. Doubles the size, unless most used
+// slots are deleted ones, then they are cleaned up by moving the keys to a
+// table of the same size.
+static void hm_grow(HMap *hmap) {
+  size_t n = hmap->newer.mask + 1;
+  if (hmap->newer.size >= h_max_used(&hmap->newer) / 2) {
+    n *= 2;
+  }
+  hm_trigger_rehashing(hmap, n);
+}
+
+// After mass deletions, e.g. expirations: shrink once under 1/8 full, to a
+// table 1/4 to 1/2 full. Far from the 7/8 that grows it, so a few inserts
+// or deletes after a resize don't trigger the opposite one.
+static void hm_maybe_shrink(HMap *hmap) {
+  size_t slots = hmap->newer.mask + 1;
+  if (hmap->older.ctrl || slots <= k_group || hmap->newer.size >= slots / 8) {
+    return;
+  }
+  size_t n = k_group;
+  while (n < hmap->newer.size * 2) {
+    n *= 2;
+  }
+  hm_trigger_rehashing(hmap, n);
+}
+
+HNode *hm_lookup(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *)) {
+  hm_help_rehashing(hmap);
+  ssize_t pos = h_lookup(&hmap->newer, key, eq);
+  if (pos >= 0) {
+    return hmap->newer.slots[pos];
+  }
+  pos = h_lookup(&hmap->older, key, eq);
+  return pos >= 0 ? hmap->older.slots[pos] : NULL;
+}
+
+static void h_prefetch_group(HTab *htab, HNode *key) {
+  if (htab->ctrl) {
+    HProbeSeq seq(htab, key->hcode);
+    __builtin_prefetch(&htab->ctrl[seq.offset()]);
+    __builtin_prefetch(&htab->slots[seq.offset()]);
+    __builtin_prefetch(&htab->slots[seq.offset() + k_group / 2]);
+  }
+}
+
+// needs the group of the key in the cache
+static void h_prefetch_node(HTab *htab, HNode *key) {
+  if (htab->ctrl) {
+    HProbeSeq seq(htab, key->hcode);
+    uint32_t m = group_match(&htab->ctrl[seq.offset()], h_tag(key->hcode));
+    if (m) {
+      __builtin_prefetch(htab->slots[seq.offset() + __builtin_ctz(m)]);
+    }
+  }
+}
+
+// Two passes: the control bytes and slots of all the keys are requested
+// at once, then the nodes whose tag matches in the first group.
+void hm_prefetch(HMap *hmap, HNode **keys, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    h_prefetch_group(&hmap->newer, keys[i]);
+    h_prefetch_group(&hmap->older, keys[i]);
+  }
+  for (size_t i = 0; i < n; i++) {
+    h_prefetch_node(&hmap->newer, keys[i]);
+    h_prefetch_node(&hmap->older, keys[i]);
+  }
+}
+
+// keys between the stages of the pipeline in hm_lookup_many()
+const size_t k_prefetch_distance = 8;
+
+// A software pipeline: while key i has its group prefetched, key i - D
+// has its node prefetched and key i - 2D is looked up, so each stage finds
+// its lines already loaded and the misses of 2D keys are in flight.
+void hm_lookup_many(HMap *hmap, HNode **keys, size_t n,
+                    bool (*eq)(HNode *, HNode *), HNode **out) {
+  const size_t d = k_prefetch_distance;
+  for (size_t i = 0; i < n + 2 * d; i++) {
+    if (i < n) {
+      h_prefetch_group(&hmap->newer, keys[i]);
+      h_prefetch_group(&hmap->older, keys[i]);
+    }
+    if (i >= d && i - d < n) {
+      h_prefetch_node(&hmap->newer, keys[i - d]);
+      h_prefetch_node(&hmap->older, keys[i - d]);
+    }
+    if (i >= 2 * d && i - 2 * d < n) {
+      size_t k = i - 2 * d;
+      if (k % k_prefetch_group == 0) {
+        hm_help_rehashing(hmap);
+      }
+      ssize_t pos = h_lookup(&hmap->newer, keys[k], eq);
+      if (pos >= 0) {
+        out[k] = hmap->newer.slots[pos];
+        continue;
+      }
+      pos = h_lookup(&hmap->older, keys[k], eq);
+      out[k] = pos >= 0 ? hmap->older.slots[pos] : NULL;
+    }
+  }
+}
+
+void hm_insert(HMap *hmap, HNode *node) {
+  if (!hmap->newer.ctrl) {
+    h_init(&hmap->newer, k_group); // initialize it if empty
+  }
+  if (hmap->newer.used >= h_max_used(&hmap->newer)) {
+    // out of free slots, finish the migration if it's still going on.
+    // doesn't happen in practice: the newer table has room for the keys
+    // of the older one long before they're all moved.
+    while (hmap->older.ctrl) {
+      hm_help_rehashing(hmap);
+    }
+    hm_grow(hmap);
+  }
+  h_insert(&hmap->newer, node); // always insert to the newer table
+  hm_help_rehashing(hmap);      // migrate some keys
+}
+
+HNode *hm_delete(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *)) {
+  hm_help_rehashing(hmap);
+  HNode *node = NULL;
+  ssize_t pos = h_lookup(&hmap->newer, key, eq);
+  if (pos >= 0) {
+    node = h_detach(&hmap->newer, (size_t)pos);
+  } else if ((pos = h_lookup(&hmap->older, key, eq)) >= 0) {
+    node = h_detach(&hmap->older, (size_t)pos);
+  }
+  if (node) {
+    hm_maybe_shrink(hmap);
+  }
+  return node;
+}
+
+static bool h_same(HNode *node, HNode *key) { return node == key; }
+
+void hm_replace(HMap *hmap, HNode *old, HNode *node) {
+  HTab *htab = &hmap->newer;
+  ssize_t pos = h_lookup(htab, old, &h_same);
+  if (pos < 0) {
+    htab = &hmap->older;
+    pos = h_lookup(htab, old, &h_same);
+  }
+  assert(pos >= 0);
+  htab->slots[pos] = node;
+}
+
+bool hm_rehashing(HMap *hmap) { return hmap->older.ctrl != NULL; }
+
+bool hm_rehash(HMap *hmap) {
+  hm_help_rehashing(hmap);
+  return hm_rehashing(hmap);
+}
+
+void hm_clear(HMap *hmap) {
+  h_free(&hmap->newer);
+  h_free(&hmap->older);
+  *hmap = HMap{};
+}
+
+size_t hm_mem(const HMap *hmap) {
+  return h_mem(&hmap->newer) + h_mem(&hmap->older);
+}
+
+size_t hm_size(HMap *hmap) { return hmap->newer.size + hmap->older.size; }
+
+static bool h_foreach(HTab *htab, bool (*f)(HNode *, void *), void *arg) {
+  for (size_t i = 0; htab->ctrl && i <= htab->mask; i++) {
+    if (htab->ctrl[i] >= 0x80 && !f(htab->slots[i], arg)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void hm_foreach(HMap *hmap, bool (*f)(HNode *, void *), void *arg) {
+  h_foreach(&hmap->newer, f, arg) && h_foreach(&hmap->older, f, arg);
+}
+
+size_t hm_sample(HMap *hmap, uint64_t pos, HNode **out, size_t n) {
+  HTab *tabs[2] = {&hmap->newer, &hmap->older};
+  size_t found = 0;
+  for (size_t step = 0; found < n && step < n * 10; step++, pos++) {
+    for (HTab *htab : tabs) {
+      size_t i = pos & htab->mask;
+      if (htab->size && found < n && htab->ctrl[i] >= 0x80) {
+        out[found++] = htab->slots[i];
+      }
+    }
+  }
+  return found;
+}
+
+// The cursor is the index of the group a key hashes to. The key may be in a
+// later group of the probe sequence, but not past the first group with an
+// empty slot, since that group had an empty slot when the key was inserted.
+static uint64_t h_scan_mask(HTab *htab) { return htab->mask / k_group; }
+
+static void h_scan(HTab *htab, size_t group, void (*f)(HNode *, void *),
+                   void *arg) {
+  HProbeSeq seq(htab, (uint64_t)group << 7);
+  for (size_t n = 0; n <= seq.gmask; n++, seq.next()) {
+    const uint8_t *ctrl = &htab->ctrl[seq.offset()];
+    for (uint32_t m = ~group_free(ctrl) & 0xFFFF; m; m &= m - 1) {
+      HNode *node = htab->slots[seq.offset() + (size_t)__builtin_ctz(m)];
+      if (((node->hcode >> 7) & seq.gmask) == group) {
+        f(node, arg);
+      }
+    }
+    if (group_match(ctrl, k_ctrl_empty)) {
+      return;
+    }
+  }
+}
+
+static uint64_t rev_bits(uint64_t v) {
+  v = ((v >> 1) & 0x5555555555555555ull) | ((v & 0x5555555555555555ull) << 1);
+  v = ((v >> 2) & 0x3333333333333333ull) | ((v & 0x3333333333333333ull) << 2);
+  v = ((v >> 4) & 0x0F0F0F0F0F0F0F0Full) | ((v & 0x0F0F0F0F0F0F0F0Full) << 4);
+  return __builtin_bswap64(v);
+}
+
+// increment the bits of `mask`, starting from the high one
+static uint64_t rev_next(uint64_t cursor, uint64_t mask) {
+  cursor |= ~mask;
+  return rev_bits(rev_bits(cursor) + 1);
+}
+
+// With both tables, the position in the smaller one and all the positions
+// it splits into in the larger one are visited together.
+uint64_t hm_scan(HMap *hmap, uint64_t cursor, void (*f)(HNode *, void *),
+                 void *arg) {
+  HTab *small = &hmap->newer;
+  HTab *large = &hmap->older;
+  if (large->size == 0) {
+    if (small->size == 0) {
+      return 0; // empty
+    }
+    h_scan(small, cursor & h_scan_mask(small), f, arg);
+    return rev_next(cursor, h_scan_mask(small));
+  }
+  if (h_scan_mask(small) > h_scan_mask(large)) {
+    std::swap(small, large);
+  }
+  uint64_t m0 = h_scan_mask(small);
+  uint64_t m1 = h_scan_mask(large);
+  // all of them: after a shrink, the high bits of a cursor from the larger
+  // table alone are part way through the reversed order
+  cursor &= m0;
+  h_scan(small, cursor, f, arg);
+  do {
+    h_scan(large, cursor & m1, f, arg);
+    // the bits of the larger mask only
+    cursor = (((cursor | m0) + 1) & ~m0) | (cursor & m0);
+  } while (cursor & (m0 ^ m1));
+  return rev_next(cursor, m0);
+}
+
+#endif // HMAP_SWISS
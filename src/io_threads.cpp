@@ -0,0 +1,68 @@
+#include "io_threads.h"
+#include "connection_manager.h"
+#include <assert.h>
+
+void io_threads_init(uint32_t n) {
+  assert(n > 1);
+  // the event loop thread takes a share of the work
+  thread_pool_init(&g_io_pool, n - 1);
+}
+
+// I/O thread: read and split the complete requests
+static void io_read(void *arg) {
+  Conn *conn = (Conn *)arg;
+  if (conn_read(conn)) {
+    conn_split(conn);
+  }
+}
+
+// I/O thread: write the responses
+static void io_write(void *arg) { handle_write((Conn *)arg); }
+
+void io_threads_handle(std::vector<IoJob> &jobs) {
+  // reused across iterations
+  static thread_local std::vector<void *> args;
+
+  // fan-out the reads
+  args.clear();
+  for (const IoJob &job : jobs) {
+    if (job.flags & EV_READ) {
+      assert(job.conn->want_read);
+      buf_acquire(job.conn->incoming); // the pool belongs to this thread
+      args.push_back(job.conn);
+    }
+  }
+  thread_pool_run_all(&g_io_pool, &io_read, args.data(), args.size());
+
+  // execute the requests on this thread
+  args.clear();
+  for (const IoJob &job : jobs) {
+    Conn *conn = job.conn;
+    if (conn->want_close) {
+      continue;
+    }
+    while (try_one_request(conn))
+      ;
+    if (!conn->outgoing.empty()) {
+      conn->want_read = false;
+      conn->want_write = true;
+    }
+    if (!conn->want_close && conn->want_write) {
+      args.push_back(conn);
+    }
+  }
+
+  // fan-out the writes
+  thread_pool_run_all(&g_io_pool, &io_write, args.data(), args.size());
+
+  // close the socket from socket error or application logic
+  for (const IoJob &job : jobs) {
+    bool err = (job.flags & EV_ERR) && conn_sock_error(job.conn);
+    if (err || job.conn->want_close) {
+      conn_destroy(job.conn);
+    } else {
+      conn_trim(job.conn);
+      conn_update_events(job.conn);
+    }
+  }
+}
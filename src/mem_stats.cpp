@@ -0,0 +1,64 @@
+#include "mem_stats.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <vector>
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<MemCounters *> g_threads; // counters of the live threads
+static int64_t g_exited[MEM_COUNT];
+
+MemCounters::MemCounters() {
+  pthread_mutex_lock(&g_lock);
+  g_threads.push_back(this);
+  pthread_mutex_unlock(&g_lock);
+}
+
+MemCounters::~MemCounters() {
+  pthread_mutex_lock(&g_lock);
+  for (uint32_t i = 0; i < MEM_COUNT; i++) {
+    g_exited[i] += bytes[i].load(std::memory_order_relaxed);
+  }
+  for (size_t i = 0; i < g_threads.size(); i++) {
+    if (g_threads[i] == this) {
+      g_threads[i] = g_threads.back();
+      g_threads.pop_back();
+      break;
+    }
+  }
+  pthread_mutex_unlock(&g_lock);
+}
+
+int64_t mem_total(uint32_t cat) {
+  pthread_mutex_lock(&g_lock);
+  int64_t sum = g_exited[cat];
+  for (MemCounters *c : g_threads) {
+    sum += c->bytes[cat].load(std::memory_order_relaxed);
+  }
+  pthread_mutex_unlock(&g_lock);
+  return sum;
+}
+
+int64_t mem_used() {
+  pthread_mutex_lock(&g_lock);
+  int64_t sum = 0;
+  for (uint32_t i = 0; i < MEM_COUNT; i++) {
+    sum += g_exited[i];
+    for (MemCounters *c : g_threads) {
+      sum += c->bytes[i].load(std::memory_order_relaxed);
+    }
+  }
+  pthread_mutex_unlock(&g_lock);
+  return sum;
+}
+
+size_t mem_rss() {
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (!f) {
+    return 0;
+  }
+  unsigned long size = 0, resident = 0;
+  int n = fscanf(f, "%lu %lu", &size, &resident);
+  fclose(f);
+  return n == 2 ? resident * (size_t)sysconf(_SC_PAGESIZE) : 0;
+}
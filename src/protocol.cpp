@@ -1,7 +1,13 @@
 #include "protocol.h"
 #include "commands.h"
+#include "evict.h"
+#include "global_state.h"
 #include <cassert>
+#include <stdio.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 // Helper functions for parsing
 static bool read_u32(const uint8_t *&cur, const uint8_t *end, uint32_t &out) {
@@ -14,11 +20,11 @@ static bool read_u32(const uint8_t *&cur, const uint8_t *end, uint32_t &out) {
 }
 
 static bool read_str(const uint8_t *&cur, const uint8_t *end, size_t n,
-                     std::string &out) {
+                     std::string_view &out) {
   if (cur + n > end) {
     return false;
   }
-  out.assign(cur, cur + n);
+  out = std::string_view((const char *)cur, n);
   cur += n;
   return true;
 }
@@ -27,8 +33,10 @@ static bool read_str(const uint8_t *&cur, const uint8_t *end, size_t n,
 // Format: +------+-----+------+-----+------+-----+-----+------+
 //         | nstr | len | str1 | len | str2 | ... | len | strn |
 //         +------+-----+------+-----+------+-----+-----+------+
+// The arguments are views into `data`, nothing is copied.
 int32_t parse_req(const uint8_t *data, size_t size,
-                  std::vector<std::string> &out) {
+                  std::vector<std::string_view> &out) {
+  out.clear(); // keeps the capacity for the next request
   const uint8_t *end = data + size;
   uint32_t nstr = 0;
   if (!read_u32(data, end, nstr)) {
@@ -43,7 +51,7 @@ int32_t parse_req(const uint8_t *data, size_t size,
     if (!read_u32(data, end, len)) {
       return -1;
     }
-    out.push_back(std::string());
+    out.push_back(std::string_view());
     if (!read_str(data, end, len, out.back())) {
       return -1;
     }
@@ -54,93 +62,420 @@ int32_t parse_req(const uint8_t *data, size_t size,
   return 0;
 }
 
-// Output serialization functions
-void out_nil(Buffer &out) { buf_append_u8(out, TAG_NIL); }
+// Choose the protocol of a connection from its first 4 bytes. A binary
+// request starts with its length, while text (a RESP array "*2\r\n" or an
+// inline command) read as a length is always above the limit.
+uint32_t sniff_proto(const uint8_t *data, size_t size) {
+  if (size < 4) {
+    return PROTO_NONE;
+  }
+  uint32_t len = 0;
+  memcpy(&len, data, 4);
+  return len > k_max_msg ? PROTO_RESP2 : PROTO_BIN;
+}
+
+// Find the next '\n', 16 bytes at a time
+static const uint8_t *find_lf(const uint8_t *cur, const uint8_t *end) {
+#ifdef __SSE2__
+  const __m128i lf = _mm_set1_epi8('\n');
+  while (end - cur >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)cur);
+    uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, lf));
+    if (mask) {
+      return cur + __builtin_ctz(mask);
+    }
+    cur += 16;
+  }
+#endif
+  while (cur < end && *cur != '\n') {
+    cur++;
+  }
+  return cur < end ? cur : NULL;
+}
+
+// Read a "<prefix><integer>\r\n" header line.
+// Returns 1 on success, 0 if incomplete, -1 on error.
+static int32_t read_header(const uint8_t *&cur, const uint8_t *end,
+                           char prefix, int64_t &out) {
+  const uint8_t *lf = find_lf(cur, end);
+  if (!lf) {
+    return (size_t)(end - cur) > k_max_line ? -1 : 0;
+  }
+  if (lf - cur < 3 || *cur != prefix || lf[-1] != '\r') {
+    return -1;
+  }
+  const uint8_t *p = cur + 1;
+  bool neg = *p == '-';
+  p += neg;
+  if (p == lf - 1 || lf - 1 - p > 18) {
+    return -1; // no digits or too many
+  }
+  int64_t val = 0;
+  for (; p < lf - 1; p++) {
+    if (*p < '0' || *p > '9') {
+      return -1;
+    }
+    val = val * 10 + (*p - '0');
+  }
+  out = neg ? -val : val;
+  cur = lf + 1;
+  return 1;
+}
+
+// Inline command: a line of arguments separated by spaces
+static int32_t parse_inline(const uint8_t *data, size_t size,
+                            std::vector<std::string_view> &out, size_t *len) {
+  const uint8_t *end = data + size;
+  const uint8_t *lf = find_lf(data, end);
+  if (!lf) {
+    return size > k_max_line ? -1 : 0;
+  }
+  *len = (size_t)(lf + 1 - data);
+  const uint8_t *line_end = lf > data && lf[-1] == '\r' ? lf - 1 : lf;
+  const uint8_t *cur = data;
+  while (cur < line_end) {
+    if (*cur == ' ' || *cur == '\t') {
+      cur++;
+      continue;
+    }
+    const uint8_t *arg = cur;
+    while (cur < line_end && *cur != ' ' && *cur != '\t') {
+      cur++;
+    }
+    if (out.size() >= k_max_args) {
+      return -1;
+    }
+    out.push_back(std::string_view((const char *)arg, (size_t)(cur - arg)));
+  }
+  return 1;
+}
+
+// Parse a RESP request, an array of bulk strings or an inline command:
+//   *<n>\r\n $<len>\r\n <bytes>\r\n ... (n times)
+// The arguments are views into `data` and `len` is set to the bytes used.
+// An empty request (blank line or empty array) has no arguments. Like a
+// binary one, the whole request is at most k_max_msg bytes.
+// Returns 1 on success, 0 if incomplete, -1 on error.
+int32_t parse_resp(const uint8_t *data, size_t size,
+                   std::vector<std::string_view> &out, size_t *len) {
+  out.clear();
+  if (size == 0) {
+    return 0;
+  }
+  if (data[0] != '*') {
+    return parse_inline(data, size, out, len);
+  }
+
+  const uint8_t *cur = data, *end = data + size;
+  int64_t nstr = 0;
+  int32_t rv = read_header(cur, end, '*', nstr);
+  if (rv <= 0) {
+    return rv;
+  }
+  if (nstr > (int64_t)k_max_args) {
+    return -1; // Safety limit
+  }
+  for (int64_t i = 0; i < nstr; i++) {
+    int64_t n = 0;
+    rv = read_header(cur, end, '$', n);
+    if (rv <= 0) {
+      return rv;
+    }
+    if (n < 0 || (size_t)(cur - data) + (size_t)n + 2 > k_max_msg) {
+      return -1; // checked before the bytes are buffered
+    }
+    if (end - cur < n + 2) {
+      return 0; // Want read
+    }
+    if (cur[n] != '\r' || cur[n + 1] != '\n') {
+      return -1;
+    }
+    out.push_back(std::string_view((const char *)cur, (size_t)n));
+    cur += n + 2;
+  }
+  *len = (size_t)(cur - data);
+  return 1;
+}
+
+// Output serialization functions.
+// The binary protocol tags every value, see the TAG_* enum. RESP uses text
+// headers ending with CRLF; nil and doubles have types of their own only
+// in RESP3, RESP2 sends them as a null or a plain bulk string.
+static bool resp() { return g_data.proto >= PROTO_RESP2; }
+
+// "<type><val>\r\n", formatted backwards without snprintf()
+static void resp_line(Buffer &out, char type, int64_t val) {
+  char line[32];
+  char *p = line + sizeof(line);
+  *--p = '\n';
+  *--p = '\r';
+  uint64_t u = val < 0 ? 0 - (uint64_t)val : (uint64_t)val;
+  do {
+    *--p = (char)('0' + u % 10);
+    u /= 10;
+  } while (u);
+  if (val < 0) {
+    *--p = '-';
+  }
+  *--p = type;
+  buf_append(out, (const uint8_t *)p, (size_t)(line + sizeof(line) - p));
+}
+
+static void resp_crlf(Buffer &out) { buf_append(out, (const uint8_t *)"\r\n", 2); }
+
+void out_nil(Buffer &out) {
+  if (!resp()) {
+    return buf_append_u8(out, TAG_NIL);
+  }
+  if (g_data.proto == PROTO_RESP3) {
+    buf_append(out, (const uint8_t *)"_\r\n", 3);
+  } else {
+    buf_append(out, (const uint8_t *)"$-1\r\n", 5);
+  }
+}
 
 void out_str(Buffer &out, const char *s, size_t size) {
-  buf_append_u8(out, TAG_STR);
-  buf_append_u32(out, (uint32_t)size);
+  if (!resp()) {
+    buf_append_u8(out, TAG_STR);
+    buf_append_u32(out, (uint32_t)size);
+    buf_append(out, (const uint8_t *)s, size);
+    return;
+  }
+  resp_line(out, '$', (int64_t)size);
   buf_append(out, (const uint8_t *)s, size);
+  resp_crlf(out);
+}
+
+void out_blob(Buffer &out, Blob *blob) {
+  if (blob->str.size() < k_out_ref_min || g_data.out_copy) {
+    return out_str(out, blob->str.data(), blob->str.size());
+  }
+  if (!resp()) {
+    buf_append_u8(out, TAG_STR);
+    buf_append_u32(out, (uint32_t)blob->str.size());
+    buf_append_ref(out, blob);
+    return;
+  }
+  resp_line(out, '$', (int64_t)blob->str.size());
+  buf_append_ref(out, blob);
+  resp_crlf(out);
 }
 
 void out_int(Buffer &out, int64_t val) {
+  if (resp()) {
+    return resp_line(out, ':', val);
+  }
   buf_append_u8(out, TAG_INT);
   buf_append_i64(out, val);
 }
 
 void out_dbl(Buffer &out, double val) {
-  buf_append_u8(out, TAG_DBL);
-  buf_append_dbl(out, val);
+  if (!resp()) {
+    buf_append_u8(out, TAG_DBL);
+    buf_append_dbl(out, val);
+    return;
+  }
+  char num[32];
+  int n = snprintf(num, sizeof(num), "%.17g", val);
+  if (g_data.proto == PROTO_RESP3) {
+    buf_append_u8(out, ',');
+    buf_append(out, (const uint8_t *)num, (size_t)n);
+    return resp_crlf(out);
+  }
+  out_str(out, num, (size_t)n);
 }
 
 void out_err(Buffer &out, uint32_t code, const std::string &msg) {
+  if (resp()) {
+    const char *prefix = code == ERR_BAD_TYP ? "-WRONGTYPE "
+                         : code == ERR_OOM   ? "-OOM "
+                                             : "-ERR ";
+    buf_append(out, (const uint8_t *)prefix, strlen(prefix));
+    buf_append(out, (const uint8_t *)msg.data(), msg.size());
+    return resp_crlf(out);
+  }
   buf_append_u8(out, TAG_ERR);
   buf_append_u32(out, code);
   buf_append_u32(out, (uint32_t)msg.size());
   buf_append(out, (const uint8_t *)msg.data(), msg.size());
 }
 
+// A short status reply such as PONG, a plain string in the binary protocol
+void out_status(Buffer &out, const char *s) {
+  if (!resp()) {
+    return out_str(out, s, strlen(s));
+  }
+  buf_append_u8(out, '+');
+  buf_append(out, (const uint8_t *)s, strlen(s));
+  resp_crlf(out);
+}
+
 void out_arr(Buffer &out, uint32_t n) {
+  if (resp()) {
+    return resp_line(out, '*', n);
+  }
   buf_append_u8(out, TAG_ARR);
   buf_append_u32(out, n);
 }
 
+// n key-value pairs, an array of 2n elements without RESP3
+void out_map(Buffer &out, uint32_t n) {
+  if (g_data.proto == PROTO_RESP3) {
+    return resp_line(out, '%', n);
+  }
+  out_arr(out, 2 * n);
+}
+
 size_t out_begin_arr(Buffer &out) {
+  if (resp()) {
+    return out.size(); // The header is inserted by out_end_arr()
+  }
   out.push_back(TAG_ARR);
   buf_append_u32(out, 0); // Filled by out_end_arr()
   return out.size() - 4;  // The `ctx` arg
 }
 
 void out_end_arr(Buffer &out, size_t ctx, uint32_t n) {
+  if (resp()) {
+    // The header length depends on `n`, move the elements to make room.
+    // They are small, referenced values only come with out_arr().
+    assert(buf_ref_bytes(out, ctx) == 0);
+    size_t size = out.size();
+    resp_line(out, '*', n);
+    size_t k = out.size() - size;
+    uint8_t line[32];
+    memcpy(line, &out[size], k);
+    memmove(&out[ctx + k], &out[ctx], size - ctx);
+    memcpy(&out[ctx], line, k);
+    return;
+  }
   assert(out[ctx - 1] == TAG_ARR);
   memcpy(&out[ctx], &n, 4);
 }
 
-// Response formatting
+// Read an array header written by out_arr() or out_end_arr().
+// Returns the header size, the elements follow it.
+size_t parse_arr(const uint8_t *data, size_t size, uint32_t *n) {
+  if (!resp()) {
+    assert(size >= 5 && data[0] == TAG_ARR);
+    memcpy(n, &data[1], 4);
+    return 5;
+  }
+  const uint8_t *cur = data;
+  int64_t val = 0;
+  int32_t rv = read_header(cur, data + size, '*', val);
+  assert(rv == 1 && val >= 0);
+  (void)rv;
+  *n = (uint32_t)val;
+  return (size_t)(cur - data);
+}
+
+// Reading back a value serialized by the out_* functions, to merge the
+// replies of the shards. The type as a TAG_*.
+uint32_t reply_tag(const uint8_t *data, size_t size) {
+  assert(size > 0);
+  if (!resp()) {
+    return data[0];
+  }
+  switch (data[0]) {
+  case '*': return TAG_ARR;
+  case ':': return TAG_INT;
+  case '-': return TAG_ERR;
+  case ',': return TAG_DBL;
+  case '_': return TAG_NIL;
+  case '$': return size > 1 && data[1] == '-' ? TAG_NIL : TAG_STR;
+  default: return TAG_STR;
+  }
+}
+
+// The size of a value that isn't an array
+size_t reply_size(const uint8_t *data, size_t size) {
+  uint32_t len = 0;
+  if (!resp()) {
+    switch (data[0]) {
+    case TAG_NIL: return 1;
+    case TAG_INT:
+    case TAG_DBL: return 9;
+    case TAG_STR: memcpy(&len, &data[1], 4); return 5 + len;
+    case TAG_ERR: memcpy(&len, &data[5], 4); return 9 + len;
+    }
+    assert(!"array");
+  }
+  const uint8_t *cur = data, *end = data + size;
+  int64_t n = 0;
+  if (data[0] == '$' && read_header(cur, end, '$', n) == 1) {
+    return (size_t)(cur - data) + (n < 0 ? 0 : (size_t)n + 2);
+  }
+  return (size_t)(find_lf(data, end) + 1 - data);
+}
+
+int64_t reply_int(const uint8_t *data, size_t size) {
+  int64_t val = 0;
+  if (!resp()) {
+    assert(size >= 9 && data[0] == TAG_INT);
+    memcpy(&val, &data[1], 8);
+    return val;
+  }
+  const uint8_t *cur = data;
+  int32_t rv = read_header(cur, data + size, ':', val);
+  assert(rv == 1);
+  (void)rv;
+  return val;
+}
+
+// Response formatting, only the binary protocol has a message header
 void response_begin(Buffer &out, size_t *header) {
-  *header = out.size();   // Message header position
-  buf_append_u32(out, 0); // Reserve space
+  *header = out.size(); // Message header position
+  if (!resp()) {
+    buf_append_u32(out, 0); // Reserve space
+  }
 }
 
 size_t response_size(Buffer &out, size_t header) {
-  return out.size() - header - 4;
+  size_t hdr = resp() ? 0 : 4;
+  return out.size() - header - hdr + buf_ref_bytes(out, header);
 }
 
 void response_end(Buffer &out, size_t header) {
   size_t msg_size = response_size(out, header);
   if (msg_size > k_max_msg) {
-    out.resize(header + 4);
+    out.resize(header + (resp() ? 0 : 4));
     out_err(out, ERR_TOO_BIG, "response is too big.");
     msg_size = response_size(out, header);
   }
+  if (resp()) {
+    return;
+  }
   // Message header
   uint32_t len = (uint32_t)msg_size;
   memcpy(&out[header], &len, 4);
 }
 
+bool admit_write(const Command *c, Buffer &out) {
+  if (!(c->flags & CMD_DENYOOM) || evict_for_write()) {
+    return true;
+  }
+  g_data.cmd_stats[c - k_commands].rejected++;
+  out_err(out, ERR_OOM, "command not allowed when used memory > "
+                        "'maxmemory'.");
+  return false;
+}
+
 // Process commands
-void do_request(std::vector<std::string> &cmd, Buffer &out) {
-  if (cmd.size() == 2 && cmd[0] == "get") {
-    return do_get(cmd, out);
-  } else if (cmd.size() == 3 && cmd[0] == "set") {
-    return do_set(cmd, out);
-  } else if (cmd.size() == 2 && cmd[0] == "del") {
-    return do_del(cmd, out);
-  } else if (cmd.size() == 3 && cmd[0] == "pexpire") {
-    return do_expire(cmd, out);
-  } else if (cmd.size() == 2 && cmd[0] == "pttl") {
-    return do_ttl(cmd, out);
-  } else if (cmd.size() == 1 && cmd[0] == "keys") {
-    return do_keys(cmd, out);
-  } else if (cmd.size() == 4 && cmd[0] == "zadd") {
-    return do_zadd(cmd, out);
-  } else if (cmd.size() == 3 && cmd[0] == "zrem") {
-    return do_zrem(cmd, out);
-  } else if (cmd.size() == 3 && cmd[0] == "zscore") {
-    return do_zscore(cmd, out);
-  } else if (cmd.size() == 6 && cmd[0] == "zquery") {
-    return do_zquery(cmd, out);
-  } else {
+void do_request(const Command *c, std::vector<std::string_view> &cmd,
+                Buffer &out) {
+  if (!c) {
     return out_err(out, ERR_UNKNOWN, "unknown command.");
   }
+  CommandStats &st = g_data.cmd_stats[c - k_commands];
+  size_t n = cmd.size();
+  if (c->arity >= 0 ? n != (size_t)c->arity : n < (size_t)-c->arity) {
+    st.rejected++;
+    return out_err(out, ERR_BAD_ARG, "wrong number of arguments.");
+  }
+  if (!g_data.write_admitted && !admit_write(c, out)) {
+    return;
+  }
+  st.calls++;
+  return c->handler(cmd, out);
 }
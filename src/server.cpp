@@ -3,6 +3,7 @@
 #include <ctime>
 #include <errno.h>
 #include <math.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,19 +11,27 @@
 // system
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <netinet/ip.h>
-#include <poll.h>
+#include <sys/random.h>
 #include <sys/socket.h>
 #include <unistd.h>
 // C++
 #include <vector>
 // custom
+#include "config.h"
 #include "connection_manager.h"
 #include "dlist.h"
+#include "evict.h"
 #include "global_state.h"
+#include "io_threads.h"
+#include "shard.h"
 #include "shared.h"
+#include "slab.h"
+#include "storage.h"
 #include "thread_pool.h"
 #include "timer.h"
+#include "uring.h"
 
 // set the fd to nonblocking mode
 static void fd_set_nb(int fd) {
@@ -42,108 +51,303 @@ static void fd_set_nb(int fd) {
   }
 }
 
-int main() {
-  dlist_init(&g_data.idle_list);
-  thread_pool_init(&g_data.thread_pool, 4);
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [--port N] [--backend poll|epoll|uring] [--shards N] "
+          "[--io-threads N] [--zerocopy BYTES] [--rehash-budget USEC] "
+          "[--defrag-budget USEC] "
+          "[--maxmemory BYTES[k|m|g]] [--maxmemory-policy noeviction|"
+          "allkeys-lru|allkeys-lfu|volatile-ttl] [--maxmemory-samples N]\n",
+          prog);
+  exit(1);
+}
+
+// a number of bytes with an optional k, m or g unit
+static bool parse_bytes(const char *val, uint64_t &out) {
+  char *end = NULL;
+  out = strtoull(val, &end, 10);
+  if (end == val) {
+    return false;
+  }
+  const char *units = "kmg";
+  if (*end && strchr(units, *end | 0x20) && !end[1]) {
+    out <<= 10 * (strchr(units, *end | 0x20) - units + 1);
+    return true;
+  }
+  return !*end;
+}
+
+// parse the command line into g_config
+static void parse_args(int argc, char **argv) {
+  for (int i = 1; i < argc; ++i) {
+    const char *arg = argv[i];
+    const char *val = i + 1 < argc ? argv[i + 1] : NULL;
+    if (!val) {
+      usage(argv[0]);
+    }
+    if (strcmp(arg, "--port") == 0) {
+      g_config.port = (uint16_t)atoi(val);
+    } else if (strcmp(arg, "--backend") == 0) {
+      if (strcmp(val, "poll") == 0) {
+        g_config.backend = EV_BACKEND_POLL;
+      } else if (strcmp(val, "epoll") == 0) {
+        g_config.backend = EV_BACKEND_EPOLL;
+      } else if (strcmp(val, "uring") == 0) {
+        g_config.backend = EV_BACKEND_URING;
+      } else {
+        usage(argv[0]);
+      }
+    } else if (strcmp(arg, "--shards") == 0) {
+      g_config.shards = (uint32_t)atoi(val);
+      if (g_config.shards < 1) {
+        usage(argv[0]);
+      }
+    } else if (strcmp(arg, "--zerocopy") == 0) {
+      g_config.zerocopy = (uint32_t)atoi(val);
+    } else if (strcmp(arg, "--rehash-budget") == 0) {
+      g_config.rehash_us = (uint32_t)atoi(val);
+    } else if (strcmp(arg, "--defrag-budget") == 0) {
+      g_config.defrag_us = (uint32_t)atoi(val);
+    } else if (strcmp(arg, "--maxmemory") == 0) {
+      if (!parse_bytes(val, g_config.maxmemory)) {
+        usage(argv[0]);
+      }
+    } else if (strcmp(arg, "--maxmemory-policy") == 0) {
+      int policy = evict_policy(val);
+      if (policy < 0) {
+        usage(argv[0]);
+      }
+      g_config.maxmemory_policy = (uint32_t)policy;
+    } else if (strcmp(arg, "--maxmemory-samples") == 0) {
+      g_config.maxmemory_samples = (uint32_t)atoi(val);
+      if (g_config.maxmemory_samples < 1) {
+        usage(argv[0]);
+      }
+    } else if (strcmp(arg, "--io-threads") == 0) {
+      g_config.io_threads = (uint32_t)atoi(val);
+      if (g_config.io_threads < 1) {
+        usage(argv[0]);
+      }
+    } else {
+      usage(argv[0]);
+    }
+    ++i;
+  }
+}
 
-  // the listening socket
+// the listening socket of the calling event loop
+static int listen_socket() {
   int fd = socket(AF_INET, SOCK_STREAM, 0);
   if (fd < 0) {
     die("socket()");
   }
   int val = 1;
   setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+  if (g_shards.size() > 1) {
+    // each shard has its own listener, the kernel balances connections
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val));
+  }
 
   // bind
   struct sockaddr_in addr = {};
   addr.sin_family = AF_INET;
-  addr.sin_port = ntohs(1234);
+  addr.sin_port = ntohs(g_config.port);
   addr.sin_addr.s_addr = ntohl(0); // wildcard address 0.0.0.0
   int rv = bind(fd, (const sockaddr *)&addr, sizeof(addr));
   if (rv) {
     die("bind()");
   }
 
-  // set the listen fd to nonblocking mode
-  fd_set_nb(fd);
-
   // listen
   rv = listen(fd, SOMAXCONN);
   if (rv) {
     die("listen()");
   }
+  return fd;
+}
 
-  // The event loop
-  std::vector<struct pollfd> poll_args;
-  while (true) {
-    // prepare the arguments of the poll()
-    poll_args.clear();
-    // put the listening sockets in the first position
-    struct pollfd pfd = {fd, POLLIN, 0};
-    poll_args.push_back(pfd);
-    // the rest are connection sockets
-    for (Conn *conn : g_data.fd2conn) {
-      if (!conn) {
-        continue;
-      }
-      // always poll() for error
-      struct pollfd pfd = {conn->fd, POLLERR, 0};
-      // poll() flags from the application's intent
-      if (conn->want_read) {
-        pfd.events |= POLLIN;
-      }
-      if (conn->want_write) {
-        pfd.events |= POLLOUT;
-      }
-      poll_args.push_back(pfd);
+// set up the backend of the calling event loop
+static void loop_init(bool can_fallback) {
+  // the completion based backend
+  if (g_config.backend == EV_BACKEND_URING) {
+    if (uring_init(&g_data.ring)) {
+      return;
+    }
+    if (!can_fallback) {
+      die("io_uring");
+    }
+    msg("io_uring is not supported, falling back to epoll");
+    g_config.backend = EV_BACKEND_EPOLL;
+  }
+
+  // the readiness based backends, poll() is always available
+  if (!ev_init(&g_data.loop, g_config.backend)) {
+    if (!can_fallback) {
+      die("ev_init");
     }
+    msg("falling back to poll()");
+    g_config.backend = EV_BACKEND_POLL;
+    ev_init(&g_data.loop, g_config.backend);
+  }
+}
+
+static void run_loop(int fd) {
+  // the completion based backend runs its own loop
+  if (g_config.backend == EV_BACKEND_URING) {
+    uring_run(&g_data.ring, fd);
+  }
 
-    // wait for readiness
-    int32_t timeout_ms = next_timer_ms();
-    int rv = poll(poll_args.data(), (nfds_t)poll_args.size(), timeout_ms);
+  // set the listen fd to nonblocking mode
+  fd_set_nb(fd);
+  ev_add(&g_data.loop, fd, EV_READ);
+  int wake_fd = g_data.shard->wake_fd;
+  if (g_shards.size() > 1) {
+    ev_add(&g_data.loop, wake_fd, EV_READ);
+  }
+
+  // The event loop
+  std::vector<Event> events;
+  std::vector<IoJob> jobs; // ready connections for the I/O threads
+  bool io_threads = g_config.io_threads > 1;
+  while (true) {
+    // wait for readiness, only check it while hashtables are migrating
+    bool rehash = g_config.rehash_us && db_rehashing();
+    int32_t timeout_ms = rehash ? 0 : next_timer_ms();
+    int rv = ev_wait(&g_data.loop, events, timeout_ms);
     if (rv < 0 && errno == EINTR) {
       continue; // not an error
     }
     if (rv < 0) {
-      die("poll");
+      die("ev_wait");
     }
-
-    // handle the listening socket
-    if (poll_args[0].revents) {
-      handle_accept(fd);
+    evict_clock_update();
+    if (rehash && events.empty()) {
+      db_rehash(g_config.rehash_us); // nothing to do, move some keys
     }
 
     // handle connection sockets
-    for (size_t i = 1; i < poll_args.size(); ++i) { // note: skip the 1st
-      uint32_t ready = poll_args[i].revents;
-      if (ready == 0) {
+    bool accept_ready = false;
+    bool wake_ready = false;
+    for (const Event &ev : events) {
+      if (ev.fd == fd) {
+        accept_ready = true;
+        continue;
+      }
+      if (ev.fd == wake_fd) {
+        wake_ready = true;
         continue;
       }
-      Conn *conn = g_data.fd2conn[poll_args[i].fd];
+      Conn *conn = g_data.fd2conn[ev.fd];
+      if (!conn || conn->want_close) {
+        continue; // closed while waiting for another shard
+      }
+
+      // update the idle timer
+      conn_touch(conn);
 
-      // update the idle timer by moving conn to the end of the list
-      conn->last_active_ms = get_monotonic_msec();
-      dlist_detach(&conn->idle_node);
-      dlist_insert_before(&g_data.idle_list, &conn->idle_node);
+      // handled together with the other ready connections
+      if (io_threads) {
+        jobs.push_back(IoJob{conn, ev.flags});
+        continue;
+      }
 
       // handle IO
-      if (ready & POLLIN) {
+      if (ev.flags & EV_READ) {
         assert(conn->want_read);
         handle_read(conn); // application logic
       }
-      if (ready & POLLOUT) {
-        assert(conn->want_write);
+      if ((ev.flags & EV_WRITE) && conn->want_write) {
         handle_write(conn); // application logic
       }
 
       // close the socket from socket error or application logic
-      if ((ready & POLLERR) || conn->want_close) {
+      if (((ev.flags & EV_ERR) && conn_sock_error(conn)) || conn->want_close) {
         conn_destroy(conn);
+      } else {
+        conn_trim(conn);
+        conn_update_events(conn);
       }
     } // for each connection sockets
 
+    if (!jobs.empty()) {
+      io_threads_handle(jobs);
+      jobs.clear();
+    }
+
+    // requests and replies from other shards
+    if (wake_ready) {
+      uint64_t cnt = 0;
+      ssize_t n = read(wake_fd, &cnt, sizeof(cnt));
+      (void)n;
+      shard_poll();
+    }
+
+    // handle the listening socket after the connections, so that a reused fd
+    // can't be confused with a connection closed in this iteration
+    if (accept_ready) {
+      handle_accept(fd);
+    }
+
     // handle timers
     process_timers();
+    // slots freed by the thread pool
+    slab_collect();
   } // the event loop
+}
+
+// the thread of shards other than the 1st one
+static void *shard_main(void *arg) {
+  g_data.shard = (Shard *)arg;
+  dlist_init(&g_data.idle_list);
+  dlist_init(&g_data.rehash_list);
+  tw_init(&g_data.timers, get_monotonic_msec());
+  int fd = listen_socket();
+  loop_init(false);
+  run_loop(fd);
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  parse_args(argc, argv);
+  // before any key is hashed
+  uint64_t seed = 0;
+  if (getrandom(&seed, sizeof(seed), 0) != sizeof(seed)) {
+    die("getrandom()");
+  }
+  hash_init(seed);
+  // writing to a closed socket is handled as an error, not a signal
+  signal(SIGPIPE, SIG_IGN);
+  thread_pool_init(&g_thread_pool, 4);
+  shards_init(g_config.shards);
+
+  // the main thread runs the 1st shard, it also decides the backend
+  g_data.shard = g_shards[0];
+  dlist_init(&g_data.idle_list);
+  dlist_init(&g_data.rehash_list);
+  tw_init(&g_data.timers, get_monotonic_msec());
+  int fd = listen_socket();
+  loop_init(true);
+  if (g_config.io_threads > 1) {
+    if (g_config.backend == EV_BACKEND_URING) {
+      // the kernel already does the socket I/O
+      msg("--io-threads is ignored with io_uring");
+      g_config.io_threads = 1;
+    } else {
+      io_threads_init(g_config.io_threads);
+    }
+  }
+  if (g_config.zerocopy && g_config.backend == EV_BACKEND_URING) {
+    msg("--zerocopy is ignored with io_uring");
+    g_config.zerocopy = 0;
+  }
+
+  for (uint32_t i = 1; i < g_shards.size(); i++) {
+    pthread_t thread;
+    int rv = pthread_create(&thread, NULL, &shard_main, g_shards[i]);
+    if (rv) {
+      die("pthread_create()");
+    }
+  }
+  run_loop(fd);
   return 0;
 }
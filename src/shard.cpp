@@ -0,0 +1,382 @@
+#include "shard.h"
+#include "commands.h"
+#include "connection_manager.h"
+#include "global_state.h"
+#include "protocol.h"
+#include "shared.h"
+#include <assert.h>
+#include <charconv>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+// The replies of a request sent to several shards, merged once all of
+// them arrived
+struct ShardGather {
+  std::vector<Buffer> parts;    // the reply of each shard, by shard id
+  std::vector<uint32_t> owners; // split commands: the shard of each key
+};
+
+static void queue_push(MsgQueue *q, ShardMsg *m) {
+  m->next.store(NULL, std::memory_order_relaxed);
+  ShardMsg *prev = q->head.exchange(m, std::memory_order_acq_rel);
+  prev->next.store(m, std::memory_order_release);
+}
+
+// returns NULL if empty, or if a producer is in the middle of a push, in
+// which case the producer wakes up the consumer again
+static ShardMsg *queue_pop(MsgQueue *q) {
+  ShardMsg *tail = q->tail;
+  ShardMsg *next = tail->next.load(std::memory_order_acquire);
+  if (tail == &q->stub) {
+    if (!next) {
+      return NULL;
+    }
+    // skip the stub
+    q->tail = next;
+    tail = next;
+    next = next->next.load(std::memory_order_acquire);
+  }
+  if (next) {
+    q->tail = next;
+    return tail;
+  }
+  if (tail != q->head.load(std::memory_order_acquire)) {
+    return NULL;
+  }
+  // `tail` is the last item, put the stub behind it so it can be popped
+  queue_push(q, &q->stub);
+  next = tail->next.load(std::memory_order_acquire);
+  if (next) {
+    q->tail = next;
+    return tail;
+  }
+  return NULL;
+}
+
+void shards_init(uint32_t n) {
+  assert(n > 0);
+  for (uint32_t i = 0; i < n; i++) {
+    Shard *shard = new Shard();
+    shard->id = i;
+    shard->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (shard->wake_fd < 0) {
+      die("eventfd()");
+    }
+    g_shards.push_back(shard);
+  }
+}
+
+static void shard_send(uint32_t dst, ShardMsg *m) {
+  Shard *shard = g_shards[dst];
+  queue_push(&shard->inbox, m);
+  // only the first message since the last wakeup needs a syscall
+  if (!shard->wake_pending.exchange(true)) {
+    uint64_t one = 1;
+    ssize_t rv = write(shard->wake_fd, &one, sizeof(one));
+    (void)rv;
+  }
+}
+
+static uint32_t shard_of(std::string_view key) {
+  uint64_t h = str_hash((const uint8_t *)key.data(), key.size());
+  // mix the bits so that the shard doesn't correlate with the hashtable slot
+  return (uint32_t)(((h * 0x9E3779B97F4A7C15ull) >> 32) % g_shards.size());
+}
+
+static ShardMsg *new_msg(Conn *conn, const Command *c, uint32_t dst) {
+  ShardMsg *m = new ShardMsg();
+  m->src = g_data.shard->id;
+  m->dst = dst;
+  m->conn = conn;
+  m->command = c;
+  m->proto = g_data.proto;
+  return m;
+}
+
+// send a copy of the whole request to another shard
+static void forward(Conn *conn, const Command *c,
+                    std::vector<std::string_view> &cmd, uint32_t dst) {
+  ShardMsg *m = new_msg(conn, c, dst);
+  // the request's bytes are gone once the caller returns
+  m->cmd.assign(cmd.begin(), cmd.end());
+  conn->remote_pending++;
+  shard_send(dst, m);
+}
+
+static void write_response(Conn *conn, Buffer &body) {
+  size_t header_pos = 0;
+  buf_acquire(conn->outgoing);
+  response_begin(conn->outgoing, &header_pos);
+  buf_append_buf(conn->outgoing, body); // large values stay referenced
+  response_end(conn->outgoing, header_pos);
+}
+
+// execute this shard's part of a request sent to several shards
+static void gather_local(ShardGather *g, const Command *c,
+                         std::vector<std::string_view> &cmd) {
+  g_data.out_copy = true;
+  do_request(c, cmd, g->parts[g_data.shard->id]);
+  g_data.out_copy = false;
+}
+
+// KEYS and INFO are answered by every shard
+static void fan_out(Conn *conn, const Command *c,
+                    std::vector<std::string_view> &cmd) {
+  uint32_t self = g_data.shard->id;
+  for (uint32_t i = 0; i < g_shards.size(); i++) {
+    if (i == self) {
+      continue;
+    }
+    ShardMsg *m = new_msg(conn, c, i);
+    m->merged = true;
+    m->cmd.assign(cmd.begin(), cmd.end());
+    conn->remote_pending++;
+    shard_send(i, m);
+  }
+  conn->gather = new ShardGather();
+  conn->gather->parts.resize(g_shards.size());
+  gather_local(conn->gather, c, cmd);
+}
+
+// A multi-key command with keys on several shards: each shard gets the
+// command with its own keys (and the arguments following each key). A
+// write passes the maxmemory gate here, for all of its parts at once, so
+// it isn't left partly applied.
+static void split(Conn *conn, const Command *c,
+                  std::vector<std::string_view> &cmd, size_t end,
+                  std::vector<uint32_t> &owners) {
+  Buffer refused;
+  if (!admit_write(c, refused)) {
+    return write_response(conn, refused);
+  }
+  ShardGather *g = new ShardGather();
+  g->parts.resize(g_shards.size());
+  g->owners.swap(owners);
+  conn->gather = g;
+
+  uint32_t self = g_data.shard->id;
+  std::vector<std::string_view> local;
+  for (uint32_t i = 0; i < g_shards.size(); i++) {
+    std::vector<std::string_view> sub(cmd.begin(), cmd.begin() + c->first_key);
+    for (size_t k = 0; k < g->owners.size(); k++) {
+      if (g->owners[k] == i) {
+        auto arg = cmd.begin() + c->first_key + k * c->key_step;
+        sub.insert(sub.end(), arg, arg + c->key_step);
+      }
+    }
+    if (sub.size() == c->first_key) {
+      continue; // no keys here
+    }
+    sub.insert(sub.end(), cmd.begin() + end, cmd.end());
+    if (i == self) {
+      local.swap(sub);
+      continue;
+    }
+    ShardMsg *m = new_msg(conn, c, i);
+    m->merged = true;
+    m->admitted = true;
+    m->cmd.assign(sub.begin(), sub.end());
+    conn->remote_pending++;
+    shard_send(i, m);
+  }
+  if (!local.empty()) {
+    g_data.write_admitted = true;
+    gather_local(g, c, local);
+    g_data.write_admitted = false;
+  }
+}
+
+// Route a command with several keys. Returns false if all of them are on
+// this shard, or for an arity error to be reported locally.
+static bool forward_keys(Conn *conn, const Command *c,
+                         std::vector<std::string_view> &cmd) {
+  size_t n = cmd.size();
+  if (c->arity >= 0 ? n != (size_t)c->arity : n < (size_t)-c->arity) {
+    return false;
+  }
+  // keys are at first_key + k * key_step up to last_key, each followed by
+  // the rest of its group, e.g. the value in MSET
+  size_t last = c->last_key < 0 ? n + c->last_key : (size_t)c->last_key;
+  if (last >= n || last < c->first_key) {
+    return false;
+  }
+  size_t end = c->first_key + ((last - c->first_key) / c->key_step + 1) *
+                                  c->key_step;
+  if (end > n) {
+    return false;
+  }
+
+  static thread_local std::vector<uint32_t> owners;
+  owners.clear();
+  bool same = true;
+  for (size_t i = c->first_key; i < end; i += c->key_step) {
+    owners.push_back(shard_of(cmd[i]));
+    same = same && owners.back() == owners[0];
+  }
+  if (!same) {
+    split(conn, c, cmd, end, owners);
+    return true;
+  }
+  if (owners[0] == g_data.shard->id) {
+    return false;
+  }
+  forward(conn, c, cmd, owners[0]);
+  return true;
+}
+
+// SCAN runs on the shard in the high bits of the cursor, which moves on to
+// the next shard once one is done. Returns false for a cursor of this
+// shard, or an invalid one to be reported locally.
+static bool forward_cursor(Conn *conn, const Command *c,
+                           std::vector<std::string_view> &cmd) {
+  uint64_t cursor = 0;
+  if (cmd.size() < 2) {
+    return false;
+  }
+  const char *end = cmd[1].data() + cmd[1].size();
+  auto res = std::from_chars(cmd[1].data(), end, cursor);
+  if (res.ec != std::errc() || res.ptr != end) {
+    return false;
+  }
+  uint64_t dst = cursor >> k_cursor_shard_shift;
+  if (dst == g_data.shard->id || dst >= g_shards.size()) {
+    return false;
+  }
+  forward(conn, c, cmd, (uint32_t)dst);
+  return true;
+}
+
+bool shard_forward(Conn *conn, const Command *c,
+                   std::vector<std::string_view> &cmd) {
+  if (g_shards.size() <= 1 || !c) {
+    return false;
+  }
+  if (c->flags & CMD_ALL_SHARDS) {
+    fan_out(conn, c, cmd);
+    return true;
+  }
+  if (c->flags & CMD_CURSOR) {
+    return forward_cursor(conn, c, cmd);
+  }
+  if (c->first_key && c->last_key != (int32_t)c->first_key) {
+    return forward_keys(conn, c, cmd);
+  }
+  if (!c->first_key || cmd.size() <= c->first_key) {
+    return false; // no key, or an arity error to report
+  }
+  uint32_t dst = shard_of(cmd[c->first_key]);
+  if (dst == g_data.shard->id) {
+    return false;
+  }
+  forward(conn, c, cmd, dst);
+  return true;
+}
+
+// Merge the replies of the shards:
+// - an error from any shard is the reply
+// - arrays: concatenated for a fan-out, in the order of the keys otherwise
+// - integers are summed, e.g. the number of deleted keys
+// - otherwise all the replies are the same, e.g. nil from MSET
+static void gather_merge(ShardGather *g, Buffer &out) {
+  Buffer *first = NULL;
+  for (Buffer &part : g->parts) {
+    if (part.empty()) {
+      continue;
+    }
+    if (reply_tag(part.data(), part.size()) == TAG_ERR) {
+      return buf_append(out, part.data(), part.size());
+    }
+    first = first ? first : &part;
+  }
+  assert(first);
+
+  uint32_t tag = reply_tag(first->data(), first->size());
+  if (tag == TAG_ARR) {
+    std::vector<size_t> pos(g->parts.size(), 0);
+    uint32_t total = 0;
+    for (size_t i = 0; i < g->parts.size(); i++) {
+      if (!g->parts[i].empty()) {
+        uint32_t n = 0;
+        pos[i] = parse_arr(g->parts[i].data(), g->parts[i].size(), &n);
+        total += n;
+      }
+    }
+    out_arr(out, total);
+    if (g->owners.empty()) {
+      for (size_t i = 0; i < g->parts.size(); i++) {
+        Buffer &part = g->parts[i];
+        buf_append(out, part.data() + pos[i], part.size() - pos[i]);
+      }
+      return;
+    }
+    for (uint32_t s : g->owners) {
+      Buffer &part = g->parts[s];
+      const uint8_t *item = part.data() + pos[s];
+      size_t size = reply_size(item, part.size() - pos[s]);
+      buf_append(out, item, size);
+      pos[s] += size;
+    }
+  } else if (tag == TAG_INT) {
+    int64_t sum = 0;
+    for (Buffer &part : g->parts) {
+      if (!part.empty()) {
+        sum += reply_int(part.data(), part.size());
+      }
+    }
+    out_int(out, sum);
+  } else {
+    buf_append(out, first->data(), first->size());
+  }
+}
+
+static void on_reply(ShardMsg *m) {
+  Conn *conn = m->conn;
+  g_data.proto = conn->proto;
+  assert(conn->remote_pending > 0);
+  conn->remote_pending--;
+  if (conn->gather) {
+    conn->gather->parts[m->dst].swap(m->out);
+  } else if (!conn->want_close) {
+    write_response(conn, m->out);
+  }
+  delete m;
+  if (conn->remote_pending > 0) {
+    return; // wait for the rest
+  }
+
+  if (ShardGather *g = conn->gather) {
+    if (!conn->want_close) {
+      size_t header_pos = 0;
+      buf_acquire(conn->outgoing);
+      response_begin(conn->outgoing, &header_pos);
+      gather_merge(g, conn->outgoing);
+      response_end(conn->outgoing, header_pos);
+    }
+    delete g;
+    conn->gather = NULL;
+  }
+  conn_resume(conn);
+}
+
+void shard_poll() {
+  Shard *shard = g_data.shard;
+  shard->wake_pending.store(false);
+  while (ShardMsg *m = queue_pop(&shard->inbox)) {
+    if (m->done) {
+      on_reply(m);
+      continue;
+    }
+    // execute the request and send the response back
+    std::vector<std::string_view> &cmd = g_data.args;
+    cmd.assign(m->cmd.begin(), m->cmd.end());
+    g_data.proto = m->proto;
+    g_data.out_copy = m->merged;
+    g_data.write_admitted = m->admitted;
+    do_request(m->command, cmd, m->out);
+    g_data.out_copy = false;
+    g_data.write_admitted = false;
+    m->done = true;
+    shard_send(m->src, m);
+  }
+}
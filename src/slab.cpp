@@ -0,0 +1,247 @@
+#include "slab.h"
+#include "dlist.h"
+#include "shared.h"
+#include <atomic>
+#include <new>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <vector>
+
+// Pages are aligned to their size, the page of a slot is found by masking
+// its address. A page holds slots of one size class, after its header.
+const size_t k_page_size = 64 * 1024;
+const size_t k_page_header = 64;
+const size_t k_os_page = 4096;
+// 8 to 256 bytes by 8, then to 512 by 32: at most 31 bytes of slack. The
+// entries and nodes are 64 bytes and more, a finer step than malloc's 16
+// keeps most of them within 7 bytes.
+const uint32_t k_classes = 40;
+// remote frees applied per slab_collect(), the rest waits for the next
+const uint32_t k_collect_max = 4096;
+
+struct SlabHeap;
+
+struct SlabPage {
+  SlabHeap *heap = NULL; // owning thread
+  DList link;            // in SlabHeap::avail while it has a free slot
+  void *free = NULL;     // freed slots, linked by their 1st word
+  uint32_t cls = 0;
+  uint32_t size = 0; // slot size
+  uint32_t cap = 0;  // slots in the page
+  uint32_t used = 0; // allocated slots
+  uint32_t bump = 0; // slots allocated once, the rest was never touched
+};
+
+static_assert(sizeof(SlabPage) <= k_page_header, "slab page header");
+
+// The pages of a thread
+struct SlabHeap {
+  DList avail[k_classes]; // pages with a free slot, allocated from the front
+  uint32_t npages[k_classes] = {}; // pages per class
+  uint64_t nslots[k_classes] = {}; // allocated slots per class
+  // Slots freed by other threads: a stack that they push to, and that
+  // the owner takes as a whole
+  std::atomic<void *> remote{NULL};
+  void *pending = NULL; // taken from `remote`, not yet applied
+  // bytes, only the owner writes
+  std::atomic<int64_t> pages{0};
+  std::atomic<int64_t> used{0};
+};
+
+static thread_local SlabHeap *g_heap = NULL;
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+// Heaps are never freed, the threads that allocate live as long as the
+// process. A heap outlives its thread for the frees of other threads.
+static std::vector<SlabHeap *> g_heaps;
+
+static uint32_t class_of(size_t n) {
+  return n <= 256 ? (uint32_t)((n + 7) / 8 - 1)
+                  : (uint32_t)(32 + (n - 256 + 31) / 32 - 1);
+}
+
+static uint32_t class_size(uint32_t cls) {
+  return cls < 32 ? (cls + 1) * 8 : 256 + (cls - 31) * 32;
+}
+
+size_t slab_round(size_t n) {
+  if (n <= k_slab_max) {
+    return class_size(class_of(n));
+  }
+  // the usable size of a glibc malloc chunk
+  return ((n + 8 + 15) & ~(size_t)15) - 8;
+}
+
+static SlabPage *page_of(void *ptr) {
+  return (SlabPage *)((uintptr_t)ptr & ~(uintptr_t)(k_page_size - 1));
+}
+
+static SlabHeap *heap_get() {
+  if (!g_heap) {
+    g_heap = new SlabHeap();
+    for (uint32_t i = 0; i < k_classes; i++) {
+      dlist_init(&g_heap->avail[i]);
+    }
+    pthread_mutex_lock(&g_lock);
+    g_heaps.push_back(g_heap);
+    pthread_mutex_unlock(&g_lock);
+  }
+  return g_heap;
+}
+
+static void counter_add(std::atomic<int64_t> &c, int64_t delta) {
+  c.store(c.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+}
+
+static SlabPage *page_new(SlabHeap *heap, uint32_t cls) {
+  void *mem = aligned_alloc(k_page_size, k_page_size);
+  if (!mem) {
+    abort();
+  }
+  heap->npages[cls]++;
+  counter_add(heap->pages, k_page_size);
+  SlabPage *page = new (mem) SlabPage();
+  page->heap = heap;
+  page->cls = cls;
+  page->size = class_size(cls);
+  page->cap = (uint32_t)((k_page_size - k_page_header) / page->size);
+  dlist_insert_before(&heap->avail[cls], &page->link);
+  return page;
+}
+
+static void page_release(SlabHeap *heap, SlabPage *page) {
+  heap->npages[page->cls]--;
+  counter_add(heap->pages, -(int64_t)k_page_size);
+  dlist_detach(&page->link);
+  page->~SlabPage();
+  // free() keeps the memory resident for the next malloc(), it's given
+  // back to the kernel. The 1st OS page has the chunk header and links.
+  madvise((char *)page + k_os_page, k_page_size - k_os_page, MADV_DONTNEED);
+  free(page);
+}
+
+void *slab_alloc(size_t n) {
+  if (n > k_slab_max) {
+    void *ptr = malloc(n);
+    if (!ptr) {
+      abort();
+    }
+    return ptr;
+  }
+  SlabHeap *heap = heap_get();
+  uint32_t cls = class_of(n);
+  DList *head = &heap->avail[cls];
+  if (dlist_empty(head)) {
+    slab_collect(); // may give back a slot of this class
+  }
+  SlabPage *page = dlist_empty(head) ? page_new(heap, cls)
+                                     : container_of(head->next, SlabPage, link);
+  void *ptr = page->free;
+  if (ptr) {
+    page->free = *(void **)ptr;
+  } else {
+    ptr = (char *)page + k_page_header + (size_t)page->bump++ * page->size;
+  }
+  page->used++;
+  heap->nslots[cls]++;
+  counter_add(heap->used, page->size);
+  if (page->used == page->cap) {
+    dlist_detach(&page->link); // full
+    page->link.prev = page->link.next = NULL;
+  }
+  return ptr;
+}
+
+// a free by the owning thread
+static void page_free(SlabHeap *heap, SlabPage *page, void *ptr) {
+  *(void **)ptr = page->free;
+  page->free = ptr;
+  page->used--;
+  heap->nslots[page->cls]--;
+  counter_add(heap->used, -(int64_t)page->size);
+  DList *head = &heap->avail[page->cls];
+  if (!page->link.next) {
+    dlist_insert_before(head, &page->link); // was full
+  } else if (page->used == 0 &&
+             !(head->next == &page->link && page->link.next == head)) {
+    page_release(heap, page); // empty, and not the last page of its class
+  }
+}
+
+void slab_free(void *ptr, size_t n) {
+  if (n > k_slab_max) {
+    free(ptr);
+    return;
+  }
+  SlabPage *page = page_of(ptr);
+  SlabHeap *heap = page->heap;
+  if (heap == g_heap) {
+    page_free(heap, page, ptr);
+    return;
+  }
+  // another thread's page, pushed to its remote frees
+  void *top = heap->remote.load(std::memory_order_relaxed);
+  do {
+    *(void **)ptr = top;
+  } while (!heap->remote.compare_exchange_weak(top, ptr,
+                                               std::memory_order_release,
+                                               std::memory_order_relaxed));
+}
+
+void slab_collect() {
+  SlabHeap *heap = g_heap;
+  if (!heap) {
+    return;
+  }
+  if (!heap->pending) {
+    heap->pending = heap->remote.exchange(NULL, std::memory_order_acquire);
+  }
+  for (uint32_t i = 0; i < k_collect_max && heap->pending; i++) {
+    void *ptr = heap->pending;
+    heap->pending = *(void **)ptr;
+    page_free(heap, page_of(ptr), ptr);
+  }
+}
+
+// Allocations are from the page at the front of the list, the others only
+// get frees. Moving the slots of the pages emptier than average to it
+// leaves the rest fuller, and the emptied pages are released.
+bool slab_defrag_hint(void *ptr, size_t n) {
+  if (n > k_slab_max) {
+    return false;
+  }
+  SlabPage *page = page_of(ptr);
+  SlabHeap *heap = page->heap;
+  if (heap != g_heap || !page->link.next) {
+    return false; // another thread's, or full
+  }
+  if (heap->avail[page->cls].next == &page->link) {
+    return false; // where it would go
+  }
+  return (uint64_t)page->used * heap->npages[page->cls] <
+         heap->nslots[page->cls];
+}
+
+static void heap_stats(SlabHeap *heap, SlabStats &stats) {
+  stats.pages += heap->pages.load(std::memory_order_relaxed);
+  stats.used += heap->used.load(std::memory_order_relaxed);
+}
+
+SlabStats slab_stats() {
+  SlabStats stats;
+  pthread_mutex_lock(&g_lock);
+  for (SlabHeap *heap : g_heaps) {
+    heap_stats(heap, stats);
+  }
+  pthread_mutex_unlock(&g_lock);
+  return stats;
+}
+
+SlabStats slab_thread_stats() {
+  SlabStats stats;
+  if (g_heap) {
+    heap_stats(g_heap, stats);
+  }
+  return stats;
+}
@@ -1,37 +1,198 @@
 #include "storage.h"
+#include "evict.h"
 #include "global_state.h"
 #include "shared.h"
+#include "slab.h"
 #include "timer.h"
+#include <new>
+#include <stdlib.h>
+#include <string.h>
 
-// Create a new entry
-Entry *entry_new(uint32_t type) {
-  Entry *ent = new Entry();
+// Create a new entry with a copy of the key, and of the value for a string.
+// A small value gets the rest of the slab slot as room to grow in place. An
+// integer needs none.
+Entry *entry_new(uint32_t type, std::string_view key, std::string_view val) {
+  size_t size = sizeof(Entry) + key.size();
+  if (type == T_STR) {
+    int64_t ival = 0;
+    bool is_int = val.size() <= k_int_str_max && str2int_exact(val, ival);
+    if (!is_int && val.size() <= k_embed_max) {
+      size += val.size();
+    }
+  }
+  size = slab_round(size);
+  Entry *ent = new (slab_alloc(size)) Entry();
+  mem_add(MEM_ENTRIES, (int64_t)size);
   ent->type = type;
+  ent->klen = (uint32_t)key.size();
+  ent->vcap = (uint8_t)(size - sizeof(Entry) - key.size());
+  ent->access = evict_access_new();
+  memcpy(ent->data, key.data(), key.size());
+  if (type == T_STR) {
+    entry_set_str(ent, val);
+  } else if (type == T_ZSET) {
+    ent->zset = new ZSet();
+    mem_add(MEM_ZSETS, sizeof(ZSet));
+  }
   return ent;
 }
 
+bool str2int_exact(std::string_view s, int64_t &out) {
+  bool neg = !s.empty() && s[0] == '-';
+  std::string_view digits = s.substr(neg);
+  if (digits.empty() || digits.size() > 19 ||
+      (digits[0] == '0' && s.size() > 1)) {
+    return false; // also rejects "-0"
+  }
+  uint64_t v = 0;
+  for (char c : digits) {
+    if (c < '0' || c > '9') {
+      return false;
+    }
+    v = v * 10 + (uint64_t)(c - '0'); // 19 digits don't overflow
+  }
+  if (v > (uint64_t)INT64_MAX + neg) {
+    return false;
+  }
+  out = neg ? (int64_t)(0 - v) : (int64_t)v;
+  return true;
+}
+
+size_t int2str(int64_t val, char *buf) {
+  uint64_t v = val < 0 ? 0 - (uint64_t)val : (uint64_t)val;
+  char tmp[k_int_str_max];
+  size_t n = 0;
+  do {
+    tmp[n++] = (char)('0' + v % 10);
+    v /= 10;
+  } while (v);
+  size_t len = 0;
+  if (val < 0) {
+    buf[len++] = '-';
+  }
+  while (n) {
+    buf[len++] = tmp[--n];
+  }
+  return len;
+}
+
+void entry_set_int(Entry *ent, int64_t val) {
+  if (ent->enc == ENC_BLOB) {
+    blob_unref(ent->blob);
+  }
+  ent->enc = ENC_INT;
+  ent->ival = val;
+}
+
+// Move an entry of the keyspace to an allocation with room for `vlen`
+// bytes of value, sized as by entry_new(). The value isn't copied.
+static Entry *entry_regrow(Entry *ent, size_t vlen) {
+  size_t old_size = sizeof(Entry) + ent->klen + ent->vcap;
+  size_t size = slab_round(sizeof(Entry) + ent->klen + vlen);
+  Entry *copy = (Entry *)slab_alloc(size);
+  memcpy((void *)copy, ent, sizeof(Entry) + ent->klen);
+  copy->vcap = (uint8_t)(size - sizeof(Entry) - ent->klen);
+  hm_replace(&g_data.db, &ent->node, &copy->node);
+  tw_moved(&copy->ttl);
+  mem_add(MEM_ENTRIES, (int64_t)size - (int64_t)old_size);
+  slab_free(ent, old_size);
+  return copy;
+}
+
+// Replace the value of a string entry. A small value that doesn't fit
+// moves the entry, returns its new address.
+Entry *entry_set_str(Entry *ent, std::string_view val) {
+  int64_t ival = 0;
+  if (val.size() <= k_int_str_max && str2int_exact(val, ival)) {
+    entry_set_int(ent, ival); // a counter, no string at all
+    return ent;
+  }
+  // the old value may still be referenced by an output buffer
+  if (ent->enc == ENC_BLOB) {
+    blob_unref(ent->blob);
+    ent->blob = NULL;
+  }
+  if (val.size() > ent->vcap && val.size() <= k_embed_max) {
+    ent = entry_regrow(ent, val.size());
+  }
+  if (val.size() <= ent->vcap) {
+    ent->enc = ENC_EMBED;
+    ent->vlen = (uint8_t)val.size();
+    memcpy(ent->data + ent->klen, val.data(), val.size());
+  } else {
+    ent->enc = ENC_BLOB;
+    ent->blob = blob_new(val);
+  }
+  return ent;
+}
+
+std::string_view entry_str(const Entry *ent, char *buf) {
+  if (ent->enc == ENC_INT) {
+    return std::string_view(buf, int2str(ent->ival, buf));
+  }
+  if (ent->enc == ENC_BLOB) {
+    return ent->blob->str;
+  }
+  return std::string_view(ent->data + ent->klen, ent->vlen);
+}
+
+// The memory of a key and its value. Without its slot in the hashtable,
+// and the values still referenced by output buffers are counted once.
+size_t entry_mem(const Entry *ent) {
+  size_t size = sizeof(Entry) + ent->klen + ent->vcap;
+  if (ent->type == T_STR && ent->enc == ENC_BLOB) {
+    size += sizeof(Blob) + ent->blob->str.capacity();
+  } else if (ent->type == T_ZSET) {
+    size += sizeof(ZSet) + ent->zset->bytes + hm_mem(&ent->zset->hmap);
+  }
+  return size;
+}
+
 // Entry deletion callback for thread pool
 static void entry_del_func(void *arg) { entry_del_sync((Entry *)arg); }
 
 // Synchronous entry deletion
 void entry_del_sync(Entry *ent) {
   if (ent->type == T_ZSET) {
-    zset_clear(&ent->zset);
+    zset_clear(ent->zset);
+    delete ent->zset;
+    mem_add(MEM_ZSETS, -(int64_t)sizeof(ZSet));
+  } else if (ent->type == T_STR && ent->enc == ENC_BLOB) {
+    blob_unref(ent->blob);
   }
-  delete ent;
+  size_t size = sizeof(Entry) + ent->klen + ent->vcap;
+  mem_add(MEM_ENTRIES, -(int64_t)size);
+  ent->~Entry();
+  slab_free(ent, size);
+}
+
+Entry *entry_defrag(Entry *ent) {
+  size_t size = sizeof(Entry) + ent->klen + ent->vcap;
+  if (!slab_defrag_hint(ent, size)) {
+    return ent;
+  }
+  Entry *copy = (Entry *)slab_alloc(size);
+  memcpy((void *)copy, ent, size);
+  hm_replace(&g_data.db, &ent->node, &copy->node);
+  tw_moved(&copy->ttl);
+  slab_free(ent, size);
+  return copy;
 }
 
 // Delete an entry (might be asynchronous)
 void entry_del(Entry *ent) {
-  entry_set_ttl(ent, -1); // Remove from the heap data structure
+  entry_set_ttl(ent, -1); // Remove from the timing wheel
+  if (ent->type == T_ZSET && ent->zset->rehash_node.next) {
+    dlist_detach(&ent->zset->rehash_node); // Not migrated by this thread now
+  }
 
   // Run the destructor in a thread pool for large data structures such as the
   // zset as deleting is O(n) operation
-  size_t set_size = (ent->type == T_ZSET) ? hm_size(&ent->zset.hmap) : 0;
+  size_t set_size = (ent->type == T_ZSET) ? zset_size(ent->zset) : 0;
   const size_t k_large_container_size = 1000;
 
   if (set_size > k_large_container_size) {
-    thread_pool_queue(&g_data.thread_pool, &entry_del_func, ent);
+    thread_pool_queue(&g_thread_pool, &entry_del_func, ent);
   } else {
     entry_del_sync(ent);
   }
@@ -39,15 +200,13 @@ void entry_del(Entry *ent) {
 
 // Set or remove TTL for an entry
 void entry_set_ttl(Entry *ent, int64_t ttl_ms) {
-  if (ttl_ms < 0 && ent->heap_idx != (size_t)-1) {
+  if (ttl_ms < 0 && tw_active(&ent->ttl)) {
     // Setting a negative TTL means removing the TTL
-    heap_delete(g_data.heap, ent->heap_idx);
-    ent->heap_idx = -1;
+    tw_remove(&g_data.timers, &ent->ttl);
   } else if (ttl_ms >= 0) {
-    // Add or update the heap data structure
+    // Add or update the timer
     uint64_t expire_at = get_monotonic_msec() + (uint64_t)ttl_ms;
-    HeapItem item = {expire_at, &ent->heap_idx};
-    heap_upsert(g_data.heap, ent->heap_idx, item);
+    tw_add(&g_data.timers, &ent->ttl, expire_at);
   }
 }
 
@@ -55,38 +214,16 @@ void entry_set_ttl(Entry *ent, int64_t ttl_ms) {
 bool entry_eq(HNode *node, HNode *key) {
   struct Entry *ent = container_of(node, struct Entry, node);
   struct LookupKey *keydata = container_of(key, struct LookupKey, node);
-  return ent->key == keydata->key;
-}
-
-// Delete an item from the heap
-void heap_delete(std::vector<HeapItem> &a, size_t pos) {
-  // Swap the erased item with the last item
-  a[pos] = a.back();
-  a.pop_back();
-  // Update the swapped item
-  if (pos < a.size()) {
-    heap_update(a.data(), pos, a.size());
-  }
-}
-
-// Insert or update an item in the heap
-void heap_upsert(std::vector<HeapItem> &a, size_t pos, HeapItem t) {
-  if (pos < a.size()) {
-    a[pos] = t; // Update an existing item
-  } else {
-    pos = a.size();
-    a.push_back(t); // Or add a new item
-  }
-  heap_update(a.data(), pos, a.size());
+  return entry_key(ent) == keydata->key;
 }
 
 // Empty ZSet for comparison
 static const ZSet k_empty_zset;
 
 // Get a ZSet from the database
-ZSet *expect_zset(std::string &s) {
+ZSet *expect_zset(std::string_view s) {
   LookupKey key;
-  key.key.swap(s);
+  key.key = s;
   key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
 
   HNode *hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
@@ -95,5 +232,36 @@ ZSet *expect_zset(std::string &s) {
   }
 
   Entry *ent = container_of(hnode, Entry, node);
-  return ent->type == T_ZSET ? &ent->zset : NULL;
+  evict_touch(ent);
+  return ent->type == T_ZSET ? ent->zset : NULL;
+}
+
+// A zset still migrating after a write is large, the small ones finish
+// within the write. Its migration is then also done in the background.
+void zset_track_rehash(ZSet *zset) {
+  if (!zset->rehash_node.next && hm_rehashing(&zset->hmap)) {
+    dlist_insert_before(&g_data.rehash_list, &zset->rehash_node);
+  }
+}
+
+bool db_rehashing() {
+  return hm_rehashing(&g_data.db) || !dlist_empty(&g_data.rehash_list);
+}
+
+// Lookups check both tables until a migration is done, and an idle map
+// never finishes. Moves keys for `budget_us`, from the top-level hashtable
+// first, then from the zsets in order.
+void db_rehash(uint64_t budget_us) {
+  uint64_t deadline = get_monotonic_usec() + budget_us;
+  while (db_rehashing() && get_monotonic_usec() < deadline) {
+    if (hm_rehashing(&g_data.db)) {
+      hm_rehash(&g_data.db);
+      continue;
+    }
+    ZSet *zset = container_of(g_data.rehash_list.next, ZSet, rehash_node);
+    if (!hm_rehash(&zset->hmap)) {
+      dlist_detach(&zset->rehash_node);
+      zset->rehash_node = DList{};
+    }
+  }
 }
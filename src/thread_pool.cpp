@@ -1,5 +1,7 @@
 #include "thread_pool.h"
 #include <assert.h>
+#include <algorithm>
+#include <atomic>
 
 static void *worker(void *arg) {
   ThreadPool *tp = (ThreadPool *)arg;
@@ -42,3 +44,66 @@ void thread_pool_queue(ThreadPool *tp, void (*f)(void *), void *arg) {
   pthread_cond_signal(&tp->not_empty);
   pthread_mutex_unlock(&tp->mu);
 }
+
+// A fan-out of thread_pool_run_all(), lives on the caller's stack
+struct Batch {
+  void (*f)(void *) = NULL;
+  void **args = NULL;
+  size_t n = 0;
+  std::atomic<size_t> next{0}; // the next arg to claim
+  // fan-in: the caller waits for all the helpers to leave the batch
+  size_t helpers = 0;
+  pthread_mutex_t mu;
+  pthread_cond_t done;
+};
+
+// claim the args one by one until none is left
+static void batch_work(Batch *b) {
+  size_t i = 0;
+  while ((i = b->next.fetch_add(1, std::memory_order_relaxed)) < b->n) {
+    b->f(b->args[i]);
+  }
+}
+
+static void batch_helper(void *arg) {
+  Batch *b = (Batch *)arg;
+  batch_work(b);
+  pthread_mutex_lock(&b->mu);
+  if (--b->helpers == 0) {
+    pthread_cond_signal(&b->done);
+  }
+  pthread_mutex_unlock(&b->mu);
+}
+
+void thread_pool_run_all(ThreadPool *tp, void (*f)(void *), void **args,
+                         size_t n) {
+  Batch b;
+  b.f = f;
+  b.args = args;
+  b.n = n;
+  // the caller is one of the workers, a single item needs no helper
+  b.helpers = n > 0 ? std::min(n - 1, tp->threads.size()) : 0;
+  if (b.helpers == 0) {
+    return batch_work(&b);
+  }
+  pthread_mutex_init(&b.mu, NULL);
+  pthread_cond_init(&b.done, NULL);
+
+  pthread_mutex_lock(&tp->mu);
+  for (size_t i = 0; i < b.helpers; ++i) {
+    tp->queue.push_back(Work{&batch_helper, &b});
+  }
+  pthread_cond_broadcast(&tp->not_empty);
+  pthread_mutex_unlock(&tp->mu);
+
+  batch_work(&b);
+
+  // `b` must outlive the helpers
+  pthread_mutex_lock(&b.mu);
+  while (b.helpers > 0) {
+    pthread_cond_wait(&b.done, &b.mu);
+  }
+  pthread_mutex_unlock(&b.mu);
+  pthread_mutex_destroy(&b.mu);
+  pthread_cond_destroy(&b.done);
+}
@@ -1,5 +1,6 @@
 #include "timer.h"
 #include "connection_manager.h"
+#include "defrag.h"
 #include "global_state.h"
 #include "shared.h"
 #include "storage.h"
@@ -11,6 +12,12 @@ uint64_t get_monotonic_msec() {
   clock_gettime(CLOCK_MONOTONIC, &tv);
   return uint64_t(tv.tv_sec) * 1000 + tv.tv_nsec / 1000 / 1000;
 }
+uint64_t get_monotonic_usec() {
+  struct timespec tv = {0, 0};
+  clock_gettime(CLOCK_MONOTONIC, &tv);
+  return uint64_t(tv.tv_sec) * 1000 * 1000 + tv.tv_nsec / 1000;
+}
+
 const uint64_t k_idle_timeout_ms = 5 * 1000;
 
 uint32_t next_timer_ms() {
@@ -21,9 +28,15 @@ uint32_t next_timer_ms() {
     Conn *conn = container_of(g_data.idle_list.next, Conn, idle_node);
     next_ms = conn->last_active_ms + k_idle_timeout_ms;
   }
-  // TTL timers using a heap
-  if (!g_data.heap.empty() && g_data.heap[0].val < next_ms) {
-    next_ms = g_data.heap[0].val;
+  // TTL timers using a timing wheel
+  uint64_t ttl_ms = tw_next(&g_data.timers);
+  if (ttl_ms < next_ms) {
+    next_ms = ttl_ms;
+  }
+  // active defragmentation
+  uint64_t defrag_ms = defrag_next_ms();
+  if (defrag_ms < next_ms) {
+    next_ms = defrag_ms;
   }
   // timeout value
   if (next_ms == (uint64_t)-1) {
@@ -48,15 +61,14 @@ void process_timers() {
     }
     conn_destroy(conn);
   }
-  // TTL timers using a heap
+  // TTL timers using a timing wheel
   const size_t k_max_works = 2000;
   size_t nworks = 0;
-  const std::vector<HeapItem> &heap = g_data.heap;
-  while (!heap.empty() && heap[0].val < now_ms) {
-    Entry *ent = container_of(heap[0].ref, Entry, heap_idx);
+  while (TimerNode *timer = tw_pop(&g_data.timers, now_ms)) {
+    Entry *ent = container_of(timer, Entry, ttl);
     HNode *node = hm_delete(&g_data.db, &ent->node, &hnode_same);
     assert(node == &ent->node);
-    // fprintf(stderr, "key expired: %s\n", ent->key.c_str());
+    // fprintf(stderr, "key expired: %.*s\n", (int)ent->klen, ent->data);
     // delete the key
     entry_del(ent);
     if (nworks++ >= k_max_works) {
@@ -64,4 +76,6 @@ void process_timers() {
       break;
     }
   }
+  // active defragmentation
+  defrag_cron(now_ms);
 }
@@ -0,0 +1,138 @@
+#include "timing_wheel.h"
+#include "shared.h"
+#include <assert.h>
+#include <string.h>
+
+static uint32_t slot_of(uint64_t t, uint32_t level) {
+  return (uint32_t)(t >> (8 * level)) & (k_tw_slots - 1);
+}
+
+void tw_init(TimingWheel *tw, uint64_t now_ms) {
+  tw->cur_ms = now_ms;
+  for (uint32_t l = 0; l < k_tw_levels; l++) {
+    for (uint32_t s = 0; s < k_tw_slots; s++) {
+      dlist_init(&tw->slots[l][s]);
+    }
+  }
+  memset(tw->used, 0, sizeof(tw->used));
+}
+
+static void place(TimingWheel *tw, TimerNode *node) {
+  // an overdue timer goes to the current tick
+  uint64_t t = node->expire_ms > tw->cur_ms ? node->expire_ms : tw->cur_ms;
+  // the highest byte that differs from the current tick
+  uint64_t diff = t ^ tw->cur_ms;
+  uint32_t level = diff ? (63 - __builtin_clzll(diff)) / 8 : 0;
+  uint32_t slot = slot_of(t, level);
+  dlist_insert_before(&tw->slots[level][slot], &node->link);
+  tw->used[level][slot / 64] |= 1ull << (slot % 64);
+}
+
+void tw_add(TimingWheel *tw, TimerNode *node, uint64_t expire_ms) {
+  if (tw_active(node)) {
+    tw_remove(tw, node);
+  }
+  node->expire_ms = expire_ms;
+  place(tw, node);
+}
+
+void tw_remove(TimingWheel *tw, TimerNode *node) {
+  assert(tw_active(node));
+  DList *rest = node->link.next;
+  dlist_detach(&node->link);
+  node->link.prev = node->link.next = NULL;
+  // a list linked to itself is an empty slot head
+  if (dlist_empty(rest)) {
+    size_t idx = rest - &tw->slots[0][0];
+    tw->used[idx / k_tw_slots][idx % k_tw_slots / 64] &= ~(1ull << (idx % 64));
+  }
+}
+
+// the first non-empty slot of a level at or after `from`, -1 if none
+static int32_t next_used(TimingWheel *tw, uint32_t level, uint32_t from) {
+  for (uint32_t w = from / 64; w < k_tw_slots / 64; w++) {
+    uint64_t bits = tw->used[level][w];
+    if (w == from / 64) {
+      bits &= ~0ull << (from % 64);
+    }
+    if (bits) {
+      return (int32_t)(w * 64 + __builtin_ctzll(bits));
+    }
+  }
+  return -1;
+}
+
+// the first tick after the current one that has work: timers expiring in
+// level 0, or a slot of an upper level to move down
+static uint64_t next_tick(TimingWheel *tw) {
+  for (uint32_t l = 0; l < k_tw_levels; l++) {
+    uint32_t cur = slot_of(tw->cur_ms, l);
+    if (cur + 1 >= k_tw_slots) {
+      continue;
+    }
+    int32_t s = next_used(tw, l, cur + 1);
+    if (s >= 0) {
+      // the start of slot `s`, keep the higher bytes
+      uint32_t shift = 8 * (l + 1);
+      uint64_t base = shift < 64 ? (tw->cur_ms >> shift) << shift : 0;
+      return base | ((uint64_t)s << (8 * l));
+    }
+  }
+  return (uint64_t)-1;
+}
+
+// move the timers of a slot down to the lower levels
+static void cascade(TimingWheel *tw, uint32_t level, uint32_t slot) {
+  DList *head = &tw->slots[level][slot];
+  while (!dlist_empty(head)) {
+    TimerNode *node = container_of(head->next, TimerNode, link);
+    tw_remove(tw, node);
+    place(tw, node);
+  }
+}
+
+// advance the current tick, entering a new slot of the upper levels
+static void move_to(TimingWheel *tw, uint64_t t) {
+  tw->cur_ms = t;
+  for (uint32_t l = k_tw_levels - 1; l >= 1; l--) {
+    if ((t & ((1ull << (8 * l)) - 1)) == 0) {
+      cascade(tw, l, slot_of(t, l));
+    }
+  }
+}
+
+TimerNode *tw_pop(TimingWheel *tw, uint64_t now_ms) {
+  while (tw->cur_ms < now_ms) {
+    DList *head = &tw->slots[0][slot_of(tw->cur_ms, 0)];
+    if (!dlist_empty(head)) {
+      TimerNode *node = container_of(head->next, TimerNode, link);
+      tw_remove(tw, node);
+      return node;
+    }
+    // skip the ticks without work
+    uint64_t next = next_tick(tw);
+    move_to(tw, next < now_ms ? next : now_ms);
+  }
+  return NULL;
+}
+
+uint64_t tw_next(TimingWheel *tw) {
+  uint64_t t = tw->cur_ms;
+  if (dlist_empty(&tw->slots[0][slot_of(t, 0)])) {
+    t = next_tick(tw);
+  }
+  // a tick is processed once the time is past it
+  return t == (uint64_t)-1 ? t : t + 1;
+}
+
+// a lower level only has timers expiring before the ones of higher levels,
+// and the slots of a level before the current one are empty
+TimerNode *tw_peek(TimingWheel *tw) {
+  for (uint32_t l = 0; l < k_tw_levels; l++) {
+    int32_t s = next_used(tw, l, slot_of(tw->cur_ms, l));
+    if (s >= 0) {
+      return container_of(tw->slots[l][s].next, TimerNode, link);
+    }
+  }
+  return NULL;
+}
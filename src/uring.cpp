@@ -0,0 +1,391 @@
+#include "uring.h"
+#include "config.h"
+#include "connection_manager.h"
+#include "evict.h"
+#include "global_state.h"
+#include "shard.h"
+#include "shared.h"
+#include "slab.h"
+#include "storage.h"
+#include "timer.h"
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+const unsigned k_ring_entries = 4096;
+// provided buffers, the kernel picks one for each recv completion
+const unsigned k_recv_bufs = 1024; // power of 2
+const size_t k_recv_buf_size = 16 * 1024;
+const uint16_t k_recv_group = 0;
+
+// user_data of a CQE: the Conn pointer tagged with the operation
+enum : uint64_t {
+  OP_ACCEPT = 0, // the multishot accept on the listening socket
+  OP_RECV = 1,
+  OP_SEND = 2,
+  OP_WAKE = 3, // a read on this shard's eventfd
+  OP_MASK = 3,
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags, const void *arg, size_t argsz) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                      arg, argsz);
+}
+
+static int sys_io_uring_register(int fd, unsigned op, const void *arg,
+                                 unsigned nr_args) {
+  return (int)syscall(__NR_io_uring_register, fd, op, arg, nr_args);
+}
+
+// multishot recv needs 6.0, the rest of the features are older
+static bool kernel_supported() {
+  struct utsname u = {};
+  int major = 0, minor = 0;
+  if (uname(&u) || sscanf(u.release, "%d.%d", &major, &minor) != 2) {
+    return false;
+  }
+  return major >= 6;
+}
+
+static void *map_ring(int fd, size_t size, off_t offset) {
+  void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, offset);
+  return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+// give a buffer back to the kernel
+static void recv_buf_push(Uring *ring, uint16_t bid) {
+  // not `br->bufs`, the flexible array member is misplaced when compiled as
+  // C++, the entries start at the beginning of the ring
+  struct io_uring_buf *bufs = (struct io_uring_buf *)ring->br;
+  struct io_uring_buf *buf = &bufs[ring->br_tail & (k_recv_bufs - 1)];
+  buf->addr = (uint64_t)(uintptr_t)(ring->bufs + bid * k_recv_buf_size);
+  buf->len = (uint32_t)k_recv_buf_size;
+  buf->bid = bid;
+  ring->br_tail++;
+  __atomic_store_n(&ring->br->tail, ring->br_tail, __ATOMIC_RELEASE);
+}
+
+static bool setup_recv_bufs(Uring *ring) {
+  size_t ring_size = k_recv_bufs * sizeof(struct io_uring_buf);
+  void *ptr = mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ptr == MAP_FAILED) {
+    return false;
+  }
+  ring->br = (struct io_uring_buf_ring *)ptr;
+
+  struct io_uring_buf_reg reg = {};
+  reg.ring_addr = (uint64_t)(uintptr_t)ring->br;
+  reg.ring_entries = k_recv_bufs;
+  reg.bgid = k_recv_group;
+  if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+    return false;
+  }
+
+  ring->bufs = (uint8_t *)malloc(k_recv_bufs * k_recv_buf_size);
+  assert(ring->bufs);
+  for (uint16_t bid = 0; bid < k_recv_bufs; bid++) {
+    recv_buf_push(ring, bid);
+  }
+  return true;
+}
+
+bool uring_init(Uring *ring) {
+  if (!kernel_supported()) {
+    return false;
+  }
+
+  struct io_uring_params p = {};
+  p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL;
+  p.cq_entries = k_ring_entries * 4; // multishot ops produce many CQEs
+  ring->fd = sys_io_uring_setup(k_ring_entries, &p);
+  if (ring->fd < 0) {
+    msg_errno("io_uring_setup()");
+    return false;
+  }
+  const uint32_t k_features = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP |
+                              IORING_FEAT_EXT_ARG;
+  if ((p.features & k_features) != k_features) {
+    (void)close(ring->fd);
+    return false;
+  }
+
+  // map the queues, SQ and CQ share a single mapping
+  size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  size_t size = sq_size > cq_size ? sq_size : cq_size;
+  uint8_t *sq = (uint8_t *)map_ring(ring->fd, size, IORING_OFF_SQ_RING);
+  ring->sqes = (struct io_uring_sqe *)map_ring(
+      ring->fd, p.sq_entries * sizeof(struct io_uring_sqe), IORING_OFF_SQES);
+  if (!sq || !ring->sqes) {
+    die("mmap()");
+  }
+  ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  ring->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+  ring->sqe_tail = *ring->sq_tail;
+  // SQ index i always uses the SQE slot i
+  unsigned *sq_array = (unsigned *)(sq + p.sq_off.array);
+  for (unsigned i = 0; i < p.sq_entries; i++) {
+    sq_array[i] = i;
+  }
+  ring->cq_head = (unsigned *)(sq + p.cq_off.head);
+  ring->cq_tail = (unsigned *)(sq + p.cq_off.tail);
+  ring->cq_mask = *(unsigned *)(sq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(sq + p.cq_off.cqes);
+
+  if (!setup_recv_bufs(ring)) {
+    msg_errno("io_uring provided buffers");
+    (void)close(ring->fd);
+    return false;
+  }
+  return true;
+}
+
+// publish the queued SQEs and wait for at least 1 CQE
+static int uring_submit(Uring *ring, unsigned min_complete, int timeout_ms) {
+  __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+  unsigned to_submit =
+      ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+  struct __kernel_timespec ts = {};
+  struct io_uring_getevents_arg arg = {};
+  arg.sigmask_sz = _NSIG / 8;
+  if (timeout_ms >= 0) {
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000 * 1000;
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+  }
+  unsigned flags = IORING_ENTER_EXT_ARG;
+  if (min_complete) {
+    flags |= IORING_ENTER_GETEVENTS;
+  }
+  return sys_io_uring_enter(ring->fd, to_submit, min_complete, flags, &arg,
+                            sizeof(arg));
+}
+
+static struct io_uring_sqe *get_sqe(Uring *ring) {
+  unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  if (ring->sqe_tail - head > ring->sq_mask) {
+    // the SQ is full, flush it without waiting
+    if (uring_submit(ring, 0, 0) < 0) {
+      die("io_uring_enter()");
+    }
+  }
+  struct io_uring_sqe *sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+  ring->sqe_tail++;
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+static void arm_accept(Uring *ring) {
+  struct io_uring_sqe *sqe = get_sqe(ring);
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = ring->listen_fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  sqe->user_data = OP_ACCEPT;
+}
+
+static void arm_recv(Uring *ring, Conn *conn) {
+  struct io_uring_sqe *sqe = get_sqe(ring);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = conn->fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = k_recv_group;
+  sqe->user_data = (uint64_t)(uintptr_t)conn | OP_RECV;
+  conn->uring_ops++;
+}
+
+// one segment per send: a run of bytes, or a referenced value
+static void submit_send(Uring *ring, Conn *conn) {
+  struct iovec iov;
+  buf_iov(conn->sending, &iov, NULL, 1);
+  struct io_uring_sqe *sqe = get_sqe(ring);
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = conn->fd;
+  sqe->addr = (uint64_t)(uintptr_t)iov.iov_base;
+  sqe->len = (uint32_t)iov.iov_len;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = (uint64_t)(uintptr_t)conn | OP_SEND;
+  conn->uring_ops++;
+  conn->send_inflight = true;
+}
+
+// send the pending responses unless a send is already in flight
+void uring_send(Uring *ring, Conn *conn) {
+  if (conn->send_inflight || conn->outgoing.empty()) {
+    return;
+  }
+  // `outgoing` can be reallocated by new responses, the in-flight data
+  // lives in `sending` until the send completes
+  assert(conn->sending.empty());
+  conn->sending.swap(conn->outgoing);
+  submit_send(ring, conn);
+}
+
+// the last completion of a closing conn frees it
+static bool conn_closing(Conn *conn) {
+  if (!conn->want_close) {
+    return false;
+  }
+  if (!conn_busy(conn)) {
+    conn_free(conn);
+  }
+  return true;
+}
+
+static void arm_wake(Uring *ring) {
+  struct io_uring_sqe *sqe = get_sqe(ring);
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = g_data.shard->wake_fd;
+  sqe->addr = (uint64_t)(uintptr_t)&ring->wake_buf;
+  sqe->len = sizeof(ring->wake_buf);
+  sqe->user_data = OP_WAKE;
+}
+
+static void on_accept(Uring *ring, struct io_uring_cqe *cqe) {
+  if (cqe->res >= 0) {
+    Conn *conn = conn_new(cqe->res);
+    arm_recv(ring, conn);
+  } else {
+    errno = -cqe->res;
+    msg_errno("accept() error");
+  }
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    arm_accept(ring); // the multishot accept was terminated
+  }
+}
+
+static void on_recv(Uring *ring, Conn *conn, struct io_uring_cqe *cqe) {
+  bool more = cqe->flags & IORING_CQE_F_MORE;
+  if (!more) {
+    conn->uring_ops--;
+  }
+  if (cqe->flags & IORING_CQE_F_BUFFER) {
+    uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    if (cqe->res > 0 && !conn->want_close && !conn->close_after_reply) {
+      buf_acquire(conn->incoming);
+      buf_append(conn->incoming, ring->bufs + bid * k_recv_buf_size,
+                 (size_t)cqe->res);
+    }
+    recv_buf_push(ring, bid);
+  }
+  if (conn_closing(conn)) {
+    return;
+  }
+
+  if (cqe->res == 0) {
+    msg(conn->incoming.size() == 0 ? "client closed" : "unexpected EOF");
+    return conn_destroy(conn);
+  }
+  if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+    errno = -cqe->res;
+    msg_errno("recv() error");
+    return conn_destroy(conn);
+  }
+
+  if (cqe->res > 0) {
+    conn_touch(conn);
+    // Keep processing requests until there is not enough data
+    while (try_one_request(conn))
+      ;
+    if (conn->want_close) {
+      return conn_destroy(conn);
+    }
+    uring_send(ring, conn);
+    conn_trim(conn);
+  }
+  if (!more) {
+    arm_recv(ring, conn); // ran out of buffers, or terminated by the kernel
+  }
+}
+
+static void on_send(Uring *ring, Conn *conn, struct io_uring_cqe *cqe) {
+  conn->uring_ops--;
+  conn->send_inflight = false;
+  if (conn_closing(conn)) {
+    return;
+  }
+  if (cqe->res < 0) {
+    errno = -cqe->res;
+    msg_errno("send() error");
+    return conn_destroy(conn);
+  }
+
+  // Remove written data, resend the rest if partially written
+  buf_consume(conn->sending, (size_t)cqe->res);
+  if (!conn->sending.empty()) {
+    return submit_send(ring, conn);
+  }
+  uring_send(ring, conn); // responses generated in the meantime
+  if (conn->close_after_reply && !conn->send_inflight) {
+    return conn_destroy(conn);
+  }
+  conn_trim(conn);
+}
+
+// returns the number of completions
+static unsigned handle_cqes(Uring *ring) {
+  unsigned head = *ring->cq_head;
+  unsigned first = head;
+  unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++) {
+    struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+    uint64_t op = cqe->user_data & OP_MASK;
+    Conn *conn = (Conn *)(uintptr_t)(cqe->user_data & ~OP_MASK);
+    if (op == OP_ACCEPT) {
+      on_accept(ring, cqe);
+    } else if (op == OP_WAKE) {
+      shard_poll();
+      arm_wake(ring);
+    } else if (op == OP_RECV) {
+      on_recv(ring, conn, cqe);
+    } else {
+      on_send(ring, conn, cqe);
+    }
+  }
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  return head - first;
+}
+
+void uring_run(Uring *ring, int listen_fd) {
+  ring->listen_fd = listen_fd;
+  arm_accept(ring);
+  if (g_shards.size() > 1) {
+    arm_wake(ring);
+  }
+  while (true) {
+    // submit everything queued by the last iteration and wait for completions,
+    // don't wait while hashtables are migrating
+    bool rehash = g_config.rehash_us && db_rehashing();
+    int32_t timeout_ms = rehash ? 0 : next_timer_ms();
+    int rv = uring_submit(ring, 1, timeout_ms);
+    if (rv < 0 && errno != ETIME && errno != EINTR && errno != EBUSY) {
+      die("io_uring_enter()");
+    }
+    evict_clock_update();
+    if (!handle_cqes(ring) && rehash) {
+      db_rehash(g_config.rehash_us); // nothing to do, move some keys
+    }
+
+    // handle timers
+    process_timers();
+    // slots freed by the thread pool
+    slab_collect();
+  }
+}
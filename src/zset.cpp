@@ -1,14 +1,52 @@
 #include <assert.h>
+#include <new>
 #include <stdlib.h>
 #include <string.h>
 // custom
+#include "mem_stats.h"
 #include "shared.h"
+#include "slab.h"
 #include "zset.h"
 
+// The (score, name) index is a B+tree. The leaves hold the members in
+// order, with their scores side by side: a search compares scores in an
+// array and only reads the names of equal scores. The leaves are linked,
+// a range is read from consecutive slots. The inner nodes count the
+// members under each child, for the offsets by rank.
+const uint32_t k_bt_max = 32;           // slots of a leaf, inner node children
+const uint32_t k_bt_min = k_bt_max / 4; // fewer than this are refilled
+
+struct ZBInner;
+
+struct ZBNode {
+  ZBInner *parent = NULL;
+  uint32_t n = 0; // slots of a leaf, children of an inner node
+  bool leaf = false;
+};
+
+struct ZBLeaf : ZBNode {
+  ZBLeaf *prev = NULL;
+  ZBLeaf *next = NULL;
+  double score[k_bt_max];
+  ZNode *node[k_bt_max];
+};
+
+// key[i] is the least member under child[i], score[i] its score. The
+// first one is unused: the search only looks for the child to go right to.
+struct ZBInner : ZBNode {
+  double score[k_bt_max];
+  ZNode *key[k_bt_max];
+  ZBNode *child[k_bt_max];
+  uint32_t cnt[k_bt_max]; // members under the child
+};
+
+static size_t znode_size(size_t len) {
+  return slab_round(sizeof(ZNode) + len);
+}
+
 static ZNode *znode_new(const char *name, size_t len, double score) {
-  ZNode *node = (ZNode *)malloc(sizeof(ZNode) + len);
-  assert(node); // not a good idea in real projects
-  avl_init(&node->tree);
+  ZNode *node = (ZNode *)slab_alloc(znode_size(len));
+  mem_add(MEM_ZSETS, (int64_t)znode_size(len));
   node->hmap.next = NULL;
   node->hmap.hcode = str_hash((uint8_t *)name, len);
   node->score = score;
@@ -17,39 +55,400 @@ static ZNode *znode_new(const char *name, size_t len, double score) {
   return node;
 }
 
-static void znode_del(ZNode *node) { free(node); }
+static void znode_del(ZNode *node) {
+  mem_add(MEM_ZSETS, -(int64_t)znode_size(node->len));
+  slab_free(node, znode_size(node->len));
+}
+
+static size_t bnode_size(bool leaf) {
+  return slab_round(leaf ? sizeof(ZBLeaf) : sizeof(ZBInner));
+}
+
+static ZBNode *bnode_new(ZSet *zset, bool leaf) {
+  size_t size = bnode_size(leaf);
+  void *mem = slab_alloc(size);
+  mem_add(MEM_ZSETS, (int64_t)size);
+  zset->bytes += size;
+  ZBNode *node = leaf ? (ZBNode *)new (mem) ZBLeaf() : new (mem) ZBInner();
+  node->leaf = leaf;
+  return node;
+}
+
+static void bnode_del(ZSet *zset, ZBNode *node) {
+  size_t size = bnode_size(node->leaf);
+  mem_add(MEM_ZSETS, -(int64_t)size);
+  zset->bytes -= size;
+  slab_free(node, size);
+}
 
 static size_t min(size_t lhs, size_t rhs) { return lhs < rhs ? lhs : rhs; }
 
-// compare by the (score, name) tuple
-static bool zless(AVLNode *lhs, double score, const char *name, size_t len) {
-  ZNode *zl = container_of(lhs, ZNode, tree);
-  if (zl->score != score) {
-    return zl->score < score;
-  }
-  int rv = memcmp(zl->name, name, min(zl->len, len));
+// compare by the name, for equal scores
+static bool name_less(const char *lname, size_t llen, const char *name,
+                      size_t len) {
+  int rv = memcmp(lname, name, min(llen, len));
   if (rv != 0) {
     return rv < 0;
   }
-  return zl->len < len;
+  return llen < len;
+}
+
+static bool name_eq(const char *lname, size_t llen, const char *name,
+                    size_t len) {
+  return llen == len && memcmp(lname, name, len) == 0;
+}
+
+// compare by the (score, name) tuple
+static bool zless(double lscore, const ZNode *lhs, const ZNode *rhs) {
+  if (lscore != rhs->score) {
+    return lscore < rhs->score;
+  }
+  return name_less(lhs->name, lhs->len, rhs->name, rhs->len);
+}
+
+// The first slot in [lo, hi) that is >= (score, name). The scores are
+// searched without branches, then the equal ones by name.
+static uint32_t lower_bound(const double *scores, ZNode *const *nodes,
+                            uint32_t lo, uint32_t hi, double score,
+                            const char *name, size_t len) {
+  uint32_t n = hi - lo;
+  while (n > 0) {
+    uint32_t half = n / 2;
+    bool less = scores[lo + half] < score;
+    lo = less ? lo + half + 1 : lo;
+    n = less ? n - half - 1 : half;
+  }
+  while (lo < hi && scores[lo] == score &&
+         name_less(nodes[lo]->name, nodes[lo]->len, name, len)) {
+    lo++;
+  }
+  return lo;
+}
+
+// the child of an inner node whose range has the key
+static uint32_t child_for(ZBInner *in, double score, const char *name,
+                          size_t len) {
+  uint32_t i = lower_bound(in->score, in->key, 1, in->n, score, name, len);
+  if (i < in->n && in->score[i] == score &&
+      name_eq(in->key[i]->name, in->key[i]->len, name, len)) {
+    return i;
+  }
+  return i - 1;
+}
+
+static ZBLeaf *find_leaf(ZSet *zset, double score, const char *name,
+                         size_t len) {
+  ZBNode *node = zset->root;
+  while (!node->leaf) {
+    ZBInner *in = (ZBInner *)node;
+    node = in->child[child_for(in, score, name, len)];
+  }
+  return (ZBLeaf *)node;
+}
+
+// the leaf and slot of a member
+static ZPos find_node(ZSet *zset, ZNode *node) {
+  ZPos pos;
+  pos.leaf = find_leaf(zset, node->score, node->name, node->len);
+  pos.idx = lower_bound(pos.leaf->score, pos.leaf->node, 0, pos.leaf->n,
+                        node->score, node->name, node->len);
+  assert(pos.idx < pos.leaf->n && pos.leaf->node[pos.idx] == node);
+  return pos;
+}
+
+static uint32_t child_index(ZBInner *parent, ZBNode *child) {
+  uint32_t i = 0;
+  while (parent->child[i] != child) {
+    i++;
+  }
+  return i;
+}
+
+static uint32_t subtree_count(ZBNode *node) {
+  if (node->leaf) {
+    return node->n;
+  }
+  ZBInner *in = (ZBInner *)node;
+  uint32_t sum = 0;
+  for (uint32_t i = 0; i < in->n; i++) {
+    sum += in->cnt[i];
+  }
+  return sum;
+}
+
+// a member was added to or removed from the leaf
+static void count_add(ZBNode *node, int32_t delta) {
+  for (ZBInner *p = node->parent; p; node = p, p = p->parent) {
+    p->cnt[child_index(p, node)] += delta;
+  }
+}
+
+// The least member under `node` changed from `old`, the separator of the
+// first ancestor that isn't the leftmost child is it
+static void fix_min(ZBNode *node, ZNode *old, ZNode *now) {
+  for (ZBInner *p = node->parent; p; node = p, p = p->parent) {
+    uint32_t i = child_index(p, node);
+    if (i > 0) {
+      assert(p->key[i] == old);
+      (void)old;
+      p->key[i] = now;
+      p->score[i] = now->score;
+      return;
+    }
+  }
 }
 
-static bool zless(AVLNode *lhs, AVLNode *rhs) {
-  ZNode *zr = container_of(rhs, ZNode, tree);
-  return zless(lhs, zr->score, zr->name, zr->len);
+static ZBInner *inner_split(ZSet *zset, ZBInner *in);
+
+// add `right` after its sibling `left`, with the least member `key`
+static void insert_child(ZSet *zset, ZBNode *left, ZBNode *right,
+                         ZNode *key) {
+  if (!left->parent) { // a new root
+    ZBInner *root = (ZBInner *)bnode_new(zset, false);
+    root->n = 1;
+    root->child[0] = left;
+    root->cnt[0] = subtree_count(left);
+    left->parent = root;
+    zset->root = root;
+  }
+  ZBInner *p = left->parent;
+  if (p->n == k_bt_max) {
+    inner_split(zset, p);
+    p = left->parent;
+  }
+  uint32_t i = child_index(p, left) + 1;
+  uint32_t move = p->n - i;
+  memmove(&p->score[i + 1], &p->score[i], move * sizeof(double));
+  memmove(&p->key[i + 1], &p->key[i], move * sizeof(ZNode *));
+  memmove(&p->child[i + 1], &p->child[i], move * sizeof(ZBNode *));
+  memmove(&p->cnt[i + 1], &p->cnt[i], move * sizeof(uint32_t));
+  p->score[i] = key->score;
+  p->key[i] = key;
+  p->child[i] = right;
+  p->cnt[i] = subtree_count(right);
+  p->cnt[i - 1] = subtree_count(left);
+  p->n++;
+  right->parent = p;
+}
+
+// move the upper half of a full inner node to a new one
+static ZBInner *inner_split(ZSet *zset, ZBInner *in) {
+  ZBInner *right = (ZBInner *)bnode_new(zset, false);
+  uint32_t half = k_bt_max / 2;
+  right->n = in->n - half;
+  memcpy(right->score, &in->score[half], right->n * sizeof(double));
+  memcpy(right->key, &in->key[half], right->n * sizeof(ZNode *));
+  memcpy(right->child, &in->child[half], right->n * sizeof(ZBNode *));
+  memcpy(right->cnt, &in->cnt[half], right->n * sizeof(uint32_t));
+  for (uint32_t i = 0; i < right->n; i++) {
+    right->child[i]->parent = right;
+  }
+  in->n = half;
+  insert_child(zset, in, right, right->key[0]);
+  return right;
 }
 
-// insert into the AVL tree
+// move the upper half of a full leaf to a new one
+static ZBLeaf *leaf_split(ZSet *zset, ZBLeaf *leaf) {
+  ZBLeaf *right = (ZBLeaf *)bnode_new(zset, true);
+  uint32_t half = k_bt_max / 2;
+  right->n = leaf->n - half;
+  memcpy(right->score, &leaf->score[half], right->n * sizeof(double));
+  memcpy(right->node, &leaf->node[half], right->n * sizeof(ZNode *));
+  leaf->n = half;
+  right->next = leaf->next;
+  if (right->next) {
+    right->next->prev = right;
+  }
+  right->prev = leaf;
+  leaf->next = right;
+  insert_child(zset, leaf, right, right->node[0]);
+  return right;
+}
+
+// insert into the B+tree
 static void tree_insert(ZSet *zset, ZNode *node) {
-  AVLNode *parent = NULL;       // insert under this node
-  AVLNode **from = &zset->root; // the incoming pointer to the next node
-  while (*from) {               // tree search
-    parent = *from;
-    from = zless(&node->tree, parent) ? &parent->left : &parent->right;
+  if (!zset->root) {
+    zset->root = bnode_new(zset, true);
+  }
+  ZBLeaf *leaf = find_leaf(zset, node->score, node->name, node->len);
+  if (leaf->n == k_bt_max) {
+    ZBLeaf *right = leaf_split(zset, leaf);
+    if (!zless(node->score, node, right->node[0])) {
+      leaf = right;
+    }
   }
-  *from = &node->tree; // attach the new node
-  node->tree.parent = parent;
-  zset->root = avl_fix(&node->tree);
+  uint32_t i = lower_bound(leaf->score, leaf->node, 0, leaf->n, node->score,
+                           node->name, node->len);
+  uint32_t move = leaf->n - i;
+  memmove(&leaf->score[i + 1], &leaf->score[i], move * sizeof(double));
+  memmove(&leaf->node[i + 1], &leaf->node[i], move * sizeof(ZNode *));
+  leaf->score[i] = node->score;
+  leaf->node[i] = node;
+  leaf->n++;
+  count_add(leaf, +1);
+}
+
+// remove child `r` of `p` by appending it to child `r - 1`
+static void merge(ZSet *zset, ZBInner *p, uint32_t r) {
+  ZBNode *left = p->child[r - 1];
+  ZBNode *right = p->child[r];
+  if (left->leaf) {
+    ZBLeaf *l = (ZBLeaf *)left, *rl = (ZBLeaf *)right;
+    memcpy(&l->score[l->n], rl->score, rl->n * sizeof(double));
+    memcpy(&l->node[l->n], rl->node, rl->n * sizeof(ZNode *));
+    l->next = rl->next;
+    if (l->next) {
+      l->next->prev = l;
+    }
+  } else {
+    ZBInner *l = (ZBInner *)left, *ri = (ZBInner *)right;
+    // the least member of `right` is in the parent
+    ri->score[0] = p->score[r];
+    ri->key[0] = p->key[r];
+    memcpy(&l->score[l->n], ri->score, ri->n * sizeof(double));
+    memcpy(&l->key[l->n], ri->key, ri->n * sizeof(ZNode *));
+    memcpy(&l->child[l->n], ri->child, ri->n * sizeof(ZBNode *));
+    memcpy(&l->cnt[l->n], ri->cnt, ri->n * sizeof(uint32_t));
+    for (uint32_t i = 0; i < ri->n; i++) {
+      ri->child[i]->parent = l;
+    }
+  }
+  left->n += right->n;
+  p->cnt[r - 1] += p->cnt[r];
+  uint32_t move = p->n - r - 1;
+  memmove(&p->score[r], &p->score[r + 1], move * sizeof(double));
+  memmove(&p->key[r], &p->key[r + 1], move * sizeof(ZNode *));
+  memmove(&p->child[r], &p->child[r + 1], move * sizeof(ZBNode *));
+  memmove(&p->cnt[r], &p->cnt[r + 1], move * sizeof(uint32_t));
+  p->n--;
+  bnode_del(zset, right);
+}
+
+// move the last slot or child of `left` to the front of `right`, the
+// child `r` of `p`
+static void shift_right(ZBInner *p, uint32_t r) {
+  ZBNode *left = p->child[r - 1];
+  ZBNode *right = p->child[r];
+  uint32_t moved = 1;
+  if (left->leaf) {
+    ZBLeaf *l = (ZBLeaf *)left, *rl = (ZBLeaf *)right;
+    memmove(&rl->score[1], rl->score, rl->n * sizeof(double));
+    memmove(&rl->node[1], rl->node, rl->n * sizeof(ZNode *));
+    rl->score[0] = l->score[l->n - 1];
+    rl->node[0] = l->node[l->n - 1];
+    p->score[r] = rl->score[0];
+    p->key[r] = rl->node[0];
+  } else {
+    ZBInner *l = (ZBInner *)left, *ri = (ZBInner *)right;
+    uint32_t last = l->n - 1;
+    memmove(&ri->score[1], ri->score, ri->n * sizeof(double));
+    memmove(&ri->key[1], ri->key, ri->n * sizeof(ZNode *));
+    memmove(&ri->child[1], ri->child, ri->n * sizeof(ZBNode *));
+    memmove(&ri->cnt[1], ri->cnt, ri->n * sizeof(uint32_t));
+    ri->score[1] = p->score[r];
+    ri->key[1] = p->key[r];
+    ri->child[0] = l->child[last];
+    ri->cnt[0] = l->cnt[last];
+    ri->child[0]->parent = ri;
+    p->score[r] = l->score[last];
+    p->key[r] = l->key[last];
+    moved = l->cnt[last];
+  }
+  left->n--;
+  right->n++;
+  p->cnt[r - 1] -= moved;
+  p->cnt[r] += moved;
+}
+
+// move the first slot or child of `right`, the child `r` of `p`, to the
+// end of `left`
+static void shift_left(ZBInner *p, uint32_t r) {
+  ZBNode *left = p->child[r - 1];
+  ZBNode *right = p->child[r];
+  uint32_t moved = 1;
+  if (left->leaf) {
+    ZBLeaf *l = (ZBLeaf *)left, *rl = (ZBLeaf *)right;
+    l->score[l->n] = rl->score[0];
+    l->node[l->n] = rl->node[0];
+    memmove(rl->score, &rl->score[1], (rl->n - 1) * sizeof(double));
+    memmove(rl->node, &rl->node[1], (rl->n - 1) * sizeof(ZNode *));
+    p->score[r] = rl->score[0];
+    p->key[r] = rl->node[0];
+  } else {
+    ZBInner *l = (ZBInner *)left, *ri = (ZBInner *)right;
+    l->score[l->n] = p->score[r];
+    l->key[l->n] = p->key[r];
+    l->child[l->n] = ri->child[0];
+    l->cnt[l->n] = ri->cnt[0];
+    l->child[l->n]->parent = l;
+    moved = ri->cnt[0];
+    p->score[r] = ri->score[1];
+    p->key[r] = ri->key[1];
+    uint32_t move = ri->n - 1;
+    memmove(ri->score, &ri->score[1], move * sizeof(double));
+    memmove(ri->key, &ri->key[1], move * sizeof(ZNode *));
+    memmove(ri->child, &ri->child[1], move * sizeof(ZBNode *));
+    memmove(ri->cnt, &ri->cnt[1], move * sizeof(uint32_t));
+  }
+  left->n++;
+  right->n--;
+  p->cnt[r - 1] += moved;
+  p->cnt[r] -= moved;
+}
+
+// refill a node with too few slots or children from a sibling
+static void rebalance(ZSet *zset, ZBNode *node) {
+  while (ZBInner *p = node->parent) {
+    if (node->n >= k_bt_min) {
+      return;
+    }
+    uint32_t i = child_index(p, node);
+    uint32_t r = i > 0 ? i : 1; // merge into the left sibling
+    ZBNode *left = p->child[r - 1];
+    ZBNode *right = p->child[r];
+    if (left->n + right->n <= k_bt_max) {
+      merge(zset, p, r);
+    } else if (node == right) {
+      shift_right(p, r);
+    } else {
+      shift_left(p, r);
+    }
+    node = p;
+  }
+  // the root
+  if (!node->leaf && node->n == 1) {
+    zset->root = ((ZBInner *)node)->child[0];
+    zset->root->parent = NULL;
+    bnode_del(zset, node);
+  } else if (node->n == 0) {
+    zset->root = NULL;
+    bnode_del(zset, node);
+  }
+}
+
+// remove from the B+tree
+static void tree_remove(ZSet *zset, ZNode *node) {
+  ZPos pos = find_node(zset, node);
+  ZBLeaf *leaf = pos.leaf;
+  count_add(leaf, -1);
+  if (pos.idx == 0) {
+    // An emptied leaf gets merged: with its left sibling, dropping its
+    // separator, or with its right one, whose least member it takes.
+    ZNode *next = leaf->n > 1  ? leaf->node[1]
+                  : leaf->next ? leaf->next->node[0]
+                               : NULL;
+    if (next) {
+      fix_min(leaf, node, next);
+    }
+  }
+  uint32_t move = leaf->n - pos.idx - 1;
+  memmove(&leaf->score[pos.idx], &leaf->score[pos.idx + 1],
+          move * sizeof(double));
+  memmove(&leaf->node[pos.idx], &leaf->node[pos.idx + 1],
+          move * sizeof(ZNode *));
+  leaf->n--;
+  rebalance(zset, leaf);
 }
 
 // update the score of an existing node
@@ -57,28 +456,11 @@ static void zset_update(ZSet *zset, ZNode *node, double score) {
   if (node->score == score) {
     return;
   }
-  // detach the tree node
-  zset->root = avl_del(&node->tree);
-  avl_init(&node->tree);
-  // reinsert the tree node
+  tree_remove(zset, node);
   node->score = score;
   tree_insert(zset, node);
 }
 
-// add a new (score, name) tuple, or update the score of the existing tuple
-bool zset_insert(ZSet *zset, const char *name, size_t len, double score) {
-  ZNode *node = zset_lookup(zset, name, len);
-  if (node) {
-    zset_update(zset, node, score);
-    return false;
-  } else {
-    node = znode_new(name, len, score);
-    hm_insert(&zset->hmap, &node->hmap);
-    tree_insert(zset, node);
-    return true;
-  }
-}
-
 // a helper structure for the hashtable lookup
 struct HKey {
   HNode node;
@@ -95,8 +477,8 @@ static bool hcmp(HNode *node, HNode *key) {
   return 0 == memcmp(znode->name, hkey->name, znode->len);
 }
 
-// lookup by name
-ZNode *zset_lookup(ZSet *zset, const char *name, size_t len) {
+// lookup by name in the hashtable
+static ZNode *znode_lookup(ZSet *zset, const char *name, size_t len) {
   if (!zset->root) {
     return NULL;
   }
@@ -109,8 +491,154 @@ ZNode *zset_lookup(ZSet *zset, const char *name, size_t len) {
   return found ? container_of(found, ZNode, hmap) : NULL;
 }
 
-// delete a node
-void zset_delete(ZSet *zset, ZNode *node) {
+// A listpack record: the score, unaligned, a byte of name length, the name
+const size_t k_lp_header = sizeof(double) + 1;
+
+static double lp_score(const char *rec) {
+  double score = 0;
+  memcpy(&score, rec, sizeof(score));
+  return score;
+}
+
+static size_t lp_len(const char *rec) {
+  return (uint8_t)rec[sizeof(double)];
+}
+
+static const char *lp_name(const char *rec) { return rec + k_lp_header; }
+
+static char *lp_next(char *rec) { return rec + k_lp_header + lp_len(rec); }
+
+static char *lp_end(ZSet *zset) { return zset->lp + zset->lp_used; }
+
+static char *lp_find(ZSet *zset, const char *name, size_t len) {
+  for (char *rec = zset->lp; rec < lp_end(zset); rec = lp_next(rec)) {
+    if (name_eq(lp_name(rec), lp_len(rec), name, len)) {
+      return rec;
+    }
+  }
+  return NULL;
+}
+
+// the first record that is >= (score, name), and its number
+static char *lp_seekge(ZSet *zset, double score, const char *name,
+                       size_t len, uint32_t &idx) {
+  char *rec = zset->lp;
+  for (idx = 0; rec < lp_end(zset); rec = lp_next(rec), idx++) {
+    double s = lp_score(rec);
+    if (s > score ||
+        (s == score && !name_less(lp_name(rec), lp_len(rec), name, len))) {
+      break;
+    }
+  }
+  return rec;
+}
+
+// reallocate the buffer, `cap` is a slab_round() size or 0 to free it
+static void lp_realloc(ZSet *zset, size_t cap) {
+  char *lp = cap ? (char *)slab_alloc(cap) : NULL;
+  if (zset->lp) {
+    if (lp) {
+      memcpy(lp, zset->lp, zset->lp_used);
+    }
+    slab_free(zset->lp, zset->lp_cap);
+  }
+  mem_add(MEM_ZSETS, (int64_t)cap - (int64_t)zset->lp_cap);
+  zset->bytes += cap - zset->lp_cap;
+  zset->lp = lp;
+  zset->lp_cap = (uint32_t)cap;
+}
+
+static void lp_insert(ZSet *zset, const char *name, size_t len,
+                      double score) {
+  uint32_t idx = 0;
+  size_t off = lp_seekge(zset, score, name, len, idx) - zset->lp;
+  size_t size = k_lp_header + len;
+  if (zset->lp_used + size > zset->lp_cap) {
+    lp_realloc(zset, slab_round(zset->lp_used + size));
+  }
+  char *rec = zset->lp + off;
+  memmove(rec + size, rec, zset->lp_used - off);
+  memcpy(rec, &score, sizeof(score));
+  rec[sizeof(double)] = (char)len;
+  memcpy(rec + k_lp_header, name, len);
+  zset->lp_used += (uint32_t)size;
+  zset->lp_count++;
+}
+
+static void lp_remove(ZSet *zset, char *rec) {
+  char *next = lp_next(rec);
+  memmove(rec, next, lp_end(zset) - next);
+  zset->lp_used -= (uint32_t)(next - rec);
+  zset->lp_count--;
+}
+
+// move the records to a B+tree and a hashtable
+static void lp_convert(ZSet *zset) {
+  for (char *rec = zset->lp; rec < lp_end(zset); rec = lp_next(rec)) {
+    ZNode *node = znode_new(lp_name(rec), lp_len(rec), lp_score(rec));
+    zset->bytes += znode_size(node->len);
+    hm_insert(&zset->hmap, &node->hmap);
+    tree_insert(zset, node);
+  }
+  lp_realloc(zset, 0);
+  zset->lp_count = zset->lp_used = 0;
+  zset->enc = ZSET_TREE;
+}
+
+// add a new (score, name) tuple, or update the score of the existing tuple
+bool zset_insert(ZSet *zset, const char *name, size_t len, double score) {
+  if (zset->enc == ZSET_LISTPACK) {
+    if (char *rec = lp_find(zset, name, len)) {
+      if (lp_score(rec) != score) {
+        lp_remove(zset, rec);
+        lp_insert(zset, name, len, score);
+      }
+      return false;
+    }
+    if (zset->lp_count < k_zset_lp_max && len <= k_zset_lp_max_name) {
+      lp_insert(zset, name, len, score);
+      return true;
+    }
+    lp_convert(zset);
+  }
+  ZNode *node = znode_lookup(zset, name, len);
+  if (node) {
+    zset_update(zset, node, score);
+    return false;
+  } else {
+    node = znode_new(name, len, score);
+    zset->bytes += znode_size(len);
+    hm_insert(&zset->hmap, &node->hmap);
+    tree_insert(zset, node);
+    return true;
+  }
+}
+
+// lookup the score by name
+bool zset_lookup(ZSet *zset, const char *name, size_t len, double &score) {
+  if (zset->enc == ZSET_LISTPACK) {
+    char *rec = lp_find(zset, name, len);
+    score = rec ? lp_score(rec) : 0;
+    return rec != NULL;
+  }
+  ZNode *node = znode_lookup(zset, name, len);
+  score = node ? node->score : 0;
+  return node != NULL;
+}
+
+// delete by name, false if it's not there
+bool zset_delete(ZSet *zset, const char *name, size_t len) {
+  if (zset->enc == ZSET_LISTPACK) {
+    char *rec = lp_find(zset, name, len);
+    if (rec) {
+      lp_remove(zset, rec);
+    }
+    return rec != NULL;
+  }
+  ZNode *node = znode_lookup(zset, name, len);
+  if (!node) {
+    return false;
+  }
   // remove from the hashtable
   HKey key;
   key.node.hcode = node->hmap.hcode;
@@ -119,43 +647,189 @@ void zset_delete(ZSet *zset, ZNode *node) {
   HNode *found = hm_delete(&zset->hmap, &key.node, &hcmp);
   assert(found);
   // remove from the tree
-  zset->root = avl_del(&node->tree);
+  tree_remove(zset, node);
   // deallocate the node
+  zset->bytes -= znode_size(node->len);
   znode_del(node);
+  return true;
+}
+
+size_t zset_size(ZSet *zset) {
+  return zset->enc == ZSET_LISTPACK ? zset->lp_count : hm_size(&zset->hmap);
 }
 
 // find the first (score, name) tuple that is >= key.
-ZNode *zset_seekge(ZSet *zset, double score, const char *name, size_t len) {
-  AVLNode *found = NULL;
-  for (AVLNode *node = zset->root; node;) {
-    if (zless(node, score, name, len)) {
-      node = node->right; // node < key
-    } else {
-      found = node; // candidate
-      node = node->left;
+ZPos zset_seekge(ZSet *zset, double score, const char *name, size_t len) {
+  ZPos pos;
+  if (zset->enc == ZSET_LISTPACK) {
+    pos.rec = lp_seekge(zset, score, name, len, pos.idx);
+    if (pos.rec == lp_end(zset)) {
+      return ZPos();
     }
+    return pos;
   }
-  return found ? container_of(found, ZNode, tree) : NULL;
+  if (!zset->root) {
+    return pos;
+  }
+  pos.leaf = find_leaf(zset, score, name, len);
+  pos.idx = lower_bound(pos.leaf->score, pos.leaf->node, 0, pos.leaf->n,
+                        score, name, len);
+  if (pos.idx == pos.leaf->n) {
+    // the next leaf starts past the key
+    pos.leaf = pos.leaf->next;
+    pos.idx = 0;
+  }
+  return pos;
 }
 
-// offset into the succeeding or preceding node.
-ZNode *znode_offset(ZNode *node, int64_t offset) {
-  AVLNode *tnode = node ? avl_offset(&node->tree, offset) : NULL;
-  return tnode ? container_of(tnode, ZNode, tree) : NULL;
+bool zpos_member(ZPos pos, double &score, std::string_view &name) {
+  if (pos.leaf) {
+    ZNode *node = pos.leaf->node[pos.idx];
+    score = node->score;
+    name = std::string_view(node->name, node->len);
+    return true;
+  }
+  if (pos.rec) {
+    score = lp_score(pos.rec);
+    name = std::string_view(lp_name(pos.rec), lp_len(pos.rec));
+    return true;
+  }
+  return false;
 }
 
-static void tree_dispose(AVLNode *node) {
-  if (!node) {
-    return;
+static uint64_t zpos_rank(ZPos pos) {
+  uint64_t rank = pos.idx;
+  ZBNode *node = pos.leaf;
+  for (ZBInner *p = node->parent; p; node = p, p = p->parent) {
+    for (uint32_t i = 0; p->child[i] != node; i++) {
+      rank += p->cnt[i];
+    }
+  }
+  return rank;
+}
+
+static ZPos zset_at(ZSet *zset, uint64_t rank) {
+  ZBNode *node = zset->root;
+  while (!node->leaf) {
+    ZBInner *in = (ZBInner *)node;
+    uint32_t i = 0;
+    while (rank >= in->cnt[i]) {
+      rank -= in->cnt[i++];
+    }
+    node = in->child[i];
+  }
+  ZPos pos;
+  pos.leaf = (ZBLeaf *)node;
+  pos.idx = (uint32_t)rank;
+  return pos;
+}
+
+// the records are walked from the position, or from the start if before it
+static ZPos lp_offset(ZSet *zset, ZPos pos, int64_t offset) {
+  int64_t idx = (int64_t)pos.idx + offset;
+  if (idx < 0 || idx >= zset->lp_count) {
+    return ZPos();
+  }
+  if (offset < 0) {
+    pos.rec = zset->lp;
+    pos.idx = 0;
+  }
+  for (; pos.idx < idx; pos.idx++) {
+    pos.rec = lp_next(pos.rec);
   }
-  tree_dispose(node->left);
-  tree_dispose(node->right);
-  znode_del(container_of(node, ZNode, tree));
+  return pos;
+}
+
+// Leaves walked for an offset before going by rank from the root
+const uint32_t k_offset_walk = 4;
+
+// offset into the succeeding or preceding position.
+ZPos znode_offset(ZSet *zset, ZPos pos, int64_t offset) {
+  if (pos.rec) {
+    return lp_offset(zset, pos, offset);
+  }
+  if (!pos.leaf) {
+    return pos;
+  }
+  ZBLeaf *leaf = pos.leaf;
+  int64_t idx = (int64_t)pos.idx + offset;
+  for (uint32_t i = 0; leaf && i < k_offset_walk; i++) {
+    if (idx < 0) {
+      leaf = leaf->prev;
+      idx += leaf ? leaf->n : 0;
+    } else if (idx >= leaf->n) {
+      idx -= leaf->n;
+      leaf = leaf->next;
+    } else {
+      pos.leaf = leaf;
+      pos.idx = (uint32_t)idx;
+      return pos;
+    }
+  }
+  if (!leaf) {
+    return ZPos();
+  }
+  int64_t rank = (int64_t)zpos_rank(pos) + offset;
+  if (rank < 0 || (uint64_t)rank >= hm_size(&zset->hmap)) {
+    return ZPos();
+  }
+  return zset_at(zset, (uint64_t)rank);
+}
+
+static void tree_dispose(ZSet *zset, ZBNode *node) {
+  if (node->leaf) {
+    ZBLeaf *leaf = (ZBLeaf *)node;
+    for (uint32_t i = 0; i < leaf->n; i++) {
+      znode_del(leaf->node[i]);
+    }
+  } else {
+    ZBInner *in = (ZBInner *)node;
+    for (uint32_t i = 0; i < in->n; i++) {
+      tree_dispose(zset, in->child[i]);
+    }
+  }
+  bnode_del(zset, node);
 }
 
 // destroy the zset
 void zset_clear(ZSet *zset) {
+  lp_realloc(zset, 0);
+  zset->lp_count = zset->lp_used = 0;
   hm_clear(&zset->hmap);
-  tree_dispose(zset->root);
+  if (zset->root) {
+    tree_dispose(zset, zset->root);
+  }
   zset->root = NULL;
+  zset->bytes = 0;
+  zset->enc = ZSET_LISTPACK;
+}
+
+ZNode *znode_defrag(ZSet *zset, ZNode *node) {
+  size_t size = znode_size(node->len);
+  if (!slab_defrag_hint(node, size)) {
+    return node;
+  }
+  ZNode *copy = (ZNode *)slab_alloc(size);
+  memcpy(copy, node, size);
+  // the links to the node in the tree: its slot, and a separator if it's
+  // the least member of a leaf
+  ZPos pos = find_node(zset, node);
+  pos.leaf->node[pos.idx] = copy;
+  if (pos.idx == 0) {
+    fix_min(pos.leaf, node, copy);
+  }
+  hm_replace(&zset->hmap, &node->hmap, &copy->hmap);
+  slab_free(node, size);
+  return copy;
+}
+
+bool zset_defrag_listpack(ZSet *zset) {
+  if (!zset->lp || !slab_defrag_hint(zset->lp, zset->lp_cap)) {
+    return false;
+  }
+  char *copy = (char *)slab_alloc(zset->lp_cap);
+  memcpy(copy, zset->lp, zset->lp_used);
+  slab_free(zset->lp, zset->lp_cap);
+  zset->lp = copy;
+  return true;
 }